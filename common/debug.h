@@ -53,6 +53,9 @@ static inline int __nine_dbg_log(enum __nine_debug_class dbcl, const char *funct
 #define WARN(args...) __NINE_DPRINTF(__NINE_DBCL_WARN, args)
 #define TRACE(args...) __NINE_DPRINTF(__NINE_DBCL_TRACE, args)
 
+/* see WINE's TRACE_ON(), for work only done to be traced */
+#define TRACE_ON() (__nine_debug_flags & (1 << __NINE_DBCL_TRACE))
+
 static inline const char *nine_dbg_sprintf(const char *format, ...) NINE_ATTR_PRINTF(1, 2);
 static inline const char *nine_dbg_sprintf(const char *format, ...)
 {
@@ -9,6 +9,7 @@ const char * const reg_path_dll_overrides = "Software\\Wine\\DllOverrides";
 const char * const reg_path_dll_redirects = "Software\\Wine\\DllRedirects";
 const char * const reg_key_d3d9 = "d3d9";
 const char * const reg_path_nine = "Software\\Wine\\Direct3DNine";
+const char * const reg_path_app_defaults = "Software\\Wine\\AppDefaults";
 const char * const reg_key_module_path = "ModulePath";
 const char * const reg_value_override = "native";
 
@@ -115,3 +116,26 @@ BOOL common_del_registry_key(LPCSTR path, LPCSTR name)
 
     return TRUE;
 }
+
+/* Looks up a Direct3DNine setting of the running application in
+ * 'HKCU\Software\Wine\AppDefaults\<app.exe>\Direct3DNine' first and falls
+ * back to the global 'HKCU\Software\Wine\Direct3DNine' */
+BOOL common_get_registry_setting(LPCSTR name, LPSTR *value)
+{
+    char exe[MAX_PATH], path[MAX_PATH + 64];
+    char *app;
+    DWORD len;
+
+    len = GetModuleFileNameA(NULL, exe, sizeof(exe));
+    if (len && len < sizeof(exe))
+    {
+        app = strrchr(exe, '\\');
+        app = app ? app + 1 : exe;
+
+        snprintf(path, sizeof(path), "%s\\%s\\Direct3DNine", reg_path_app_defaults, app);
+        if (common_get_registry_string(path, name, value))
+            return TRUE;
+    }
+
+    return common_get_registry_string(reg_path_nine, name, value);
+}
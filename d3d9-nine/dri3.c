@@ -9,6 +9,10 @@
 #include <windows.h>
 #include <X11/Xlib-xcb.h>
 #include <xcb/dri3.h>
+#ifdef D3D9NINE_XSHMFENCE
+#include <X11/xshmfence.h>
+#include <xcb/sync.h>
+#endif
 #include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -90,6 +94,37 @@ static int dri3_get_fd(struct dri_backend_priv *priv)
     return p->fd;
 }
 
+#ifdef D3D9NINE_XSHMFENCE
+/* Sends the creation of an idle fence, so that the releases of the pixmap
+ * don't have to go through the IdleNotify events. Optional. The caller
+ * checks the request, in the round trip checking the pixmap. */
+static BOOL dri3_create_idle_fence(xcb_connection_t *xcb_connection, Window root,
+        uint32_t *fence, struct xshmfence **shm_fence, xcb_void_cookie_t *cookie)
+{
+    int fd;
+
+    fd = xshmfence_alloc_shm();
+    if (fd < 0)
+    {
+        WARN("xshmfence_alloc_shm failed\n");
+        return FALSE;
+    }
+
+    *shm_fence = xshmfence_map_shm(fd);
+    if (!*shm_fence)
+    {
+        WARN("xshmfence_map_shm failed\n");
+        close(fd);
+        return FALSE;
+    }
+
+    /* The buffer is idle until presented, xcb takes care of closing fd */
+    *cookie = xcb_dri3_fence_from_fd_checked(xcb_connection, root,
+            (*fence = xcb_generate_id(xcb_connection)), TRUE, fd);
+    return TRUE;
+}
+#endif
+
 static BOOL dri3_window_buffer_from_dmabuf(struct dri_backend_priv *priv,
     PRESENTpriv *present_priv, int fd, int width, int height,
     int stride, int depth, int bpp, struct D3DWindowBuffer **out)
@@ -100,6 +135,12 @@ static BOOL dri3_window_buffer_from_dmabuf(struct dri_backend_priv *priv,
     Window root = RootWindow(p->dpy, p->screen);
     xcb_void_cookie_t cookie;
     xcb_generic_error_t *error;
+#ifdef D3D9NINE_XSHMFENCE
+    struct xshmfence *shm_fence = NULL;
+    xcb_void_cookie_t fence_cookie;
+    uint32_t fence = 0;
+    BOOL has_fence;
+#endif
 
     TRACE("present_priv=%p dmaBufFd=%d\n", present_priv, fd);
 
@@ -114,21 +155,56 @@ static BOOL dri3_window_buffer_from_dmabuf(struct dri_backend_priv *priv,
     cookie = xcb_dri3_pixmap_from_buffer_checked(xcb_connection,
             (pixmap = xcb_generate_id(xcb_connection)), root, 0,
             width, height, stride, depth, bpp, fd);
-
-    error = xcb_request_check(xcb_connection, cookie); /* performs a flush */
+#ifdef D3D9NINE_XSHMFENCE
+    has_fence = dri3_create_idle_fence(xcb_connection, root, &fence, &shm_fence, &fence_cookie);
+#endif
+
+    /* performs a flush, and a round trip covering the fence as well */
+    error = xcb_request_check(xcb_connection, cookie);
+#ifdef D3D9NINE_XSHMFENCE
+    if (has_fence)
+    {
+        xcb_generic_error_t *fence_error = xcb_request_check(xcb_connection, fence_cookie);
+
+        if (fence_error || error)
+        {
+            if (fence_error)
+                WARN("Error using DRI3 to create an idle fence, using events\n");
+            else
+                xcb_sync_destroy_fence(xcb_connection, fence);
+            free(fence_error);
+            xshmfence_unmap_shm(shm_fence);
+            has_fence = FALSE;
+        }
+    }
+#endif
     if (error)
     {
         ERR("Error using DRI3 to convert a DmaBufFd to pixmap\n");
+        free(error);
         goto err;
     }
 
-    if (!PRESENTPixmapInit(present_priv, pixmap, &((*out)->present_pixmap_priv)))
+    if (!PRESENTPixmapInitWithSize(present_priv, pixmap, width, height, depth,
+            &((*out)->present_pixmap_priv)))
     {
         ERR("PRESENTPixmapInit failed\n");
+#ifdef D3D9NINE_XSHMFENCE
+        if (has_fence)
+        {
+            xcb_sync_destroy_fence(xcb_connection, fence);
+            xshmfence_unmap_shm(shm_fence);
+        }
+#endif
         HeapFree(GetProcessHeap(), 0, *out);
         return FALSE;
     }
 
+#ifdef D3D9NINE_XSHMFENCE
+    if (has_fence)
+        PRESENTPixmapSetIdleFence((*out)->present_pixmap_priv, fence, shm_fence);
+#endif
+
     return TRUE;
 
 err:
@@ -27,10 +27,12 @@
 #include <X11/Xutil.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <dlfcn.h>
 
 #include "../common/debug.h"
 #include "../common/library.h"
+#include "../common/registry.h"
 #include "backend.h"
 #include "wndproc.h"
 #include "xcb_present.h"
@@ -39,6 +41,10 @@
 #define D3DPRESENT_DONOTWAIT      0x00000001
 #endif
 
+/* see IDirect3DDevice9Ex::SetMaximumFrameLatency() */
+#define DEFAULT_MAX_FRAME_LATENCY 3
+#define MAX_FRAME_LATENCY_LIMIT   30
+
 #define D3DADAPTER_DRIVER_PRESENT_VERSION_MAJOR 1
 #if defined (ID3DPresent_SetPresentParameters2)
 /* version 1.4 doesn't introduce a new member, but expects
@@ -130,11 +136,19 @@ struct DRIPresent
 
     UINT present_interval;
     BOOL present_async;
+    BOOL present_mailbox; /* tear free, newer presents replace queued ones */
+    BOOL adaptive_vsync; /* tear instead of waiting another vblank when late */
+    LONG geom_generation; /* of the geometry the drawable offset was computed with */
     BOOL present_swapeffectcopy;
     BOOL allow_discard_delayed_release;
     BOOL tear_free_discard;
     struct d3d_drawable *d3d;
 
+    int max_frame_latency; /* presents queued at most, 0 when auto-tuned */
+    int frame_latency; /* auto-tuned limit */
+    LONGLONG last_present_qpc; /* end of the last frame latency wait */
+    LONGLONG frame_work_time; /* smoothed time between presents in microseconds */
+
     struct dri_backend *dri_backend;
 };
 
@@ -500,6 +514,8 @@ static void update_presentation_interval(struct DRIPresent *This)
             break;
     }
 
+    This->present_mailbox = This->present_interval == 0 && !This->present_async;
+
     /* D3DSWAPEFFECT_COPY: Force Copy.
      * This->present_interval == 0: Force Copy to have buffers
      * release as soon as possible (the display server/compositor
@@ -512,6 +528,98 @@ static void update_presentation_interval(struct DRIPresent *This)
           This->allow_discard_delayed_release));
 }
 
+static BOOL get_adaptive_vsync(void)
+{
+    const char *env;
+    char *reg = NULL;
+    BOOL value = FALSE;
+
+    env = getenv("D3D_ADAPTIVE_VSYNC");
+    if (!env && common_get_registry_setting("AdaptiveVsync", &reg))
+        env = reg;
+
+    if (env)
+        value = atoi(env) != 0;
+
+    HeapFree(GetProcessHeap(), 0, reg);
+    TRACE("Adaptive vsync: %d\n", value);
+    return value;
+}
+
+/* Returns 0 to auto-tune the limit */
+static int get_max_frame_latency(void)
+{
+    const char *env;
+    char *reg = NULL;
+    int value = DEFAULT_MAX_FRAME_LATENCY;
+
+    env = getenv("D3D_MAX_FRAME_LATENCY");
+    if (!env && common_get_registry_setting("MaxFrameLatency", &reg))
+        env = reg;
+
+    if (env)
+    {
+        if (!strcmp(env, "auto"))
+            value = 0;
+        else if (atoi(env) > 0 && atoi(env) <= MAX_FRAME_LATENCY_LIMIT)
+            value = atoi(env);
+        else
+            WARN("Ignoring invalid MaxFrameLatency '%s'\n", env);
+    }
+
+    HeapFree(GetProcessHeap(), 0, reg);
+    TRACE("Max frame latency: %d\n", value);
+    return value;
+}
+
+/* Blocks until less than the allowed number of presents are queued.
+ * When auto-tuning, the time the application spends between presents
+ * is compared to the refresh period: an application faster than the
+ * display only gains latency by queuing more frames. */
+static HRESULT wait_frame_latency(struct DRIPresent *This, DWORD Flags)
+{
+    LARGE_INTEGER counter, freq;
+    uint64_t period;
+    LONGLONG work;
+    int limit = This->max_frame_latency;
+
+    if (!limit)
+    {
+        QueryPerformanceCounter(&counter);
+        QueryPerformanceFrequency(&freq);
+        if (This->last_present_qpc &&
+                PRESENTGetRefreshPeriod(This->present_priv, &period))
+        {
+            work = (counter.QuadPart - This->last_present_qpc) * 1000000 / freq.QuadPart;
+            This->frame_work_time = (This->frame_work_time * 7 + work) / 8;
+
+            if (This->frame_work_time * 4 < period * 3)
+                limit = 1;
+            else if (This->frame_work_time < period)
+                limit = 2;
+            else
+                limit = DEFAULT_MAX_FRAME_LATENCY;
+
+            if (limit != This->frame_latency)
+                TRACE("Frame latency %d -> %d (frame %lld us, refresh %llu us)\n",
+                      This->frame_latency, limit, (long long)This->frame_work_time,
+                      (unsigned long long)period);
+            This->frame_latency = limit;
+        }
+        limit = This->frame_latency;
+    }
+
+    if (!PRESENTWaitPendingPresents(This->present_priv, limit, Flags & D3DPRESENT_DONOTWAIT))
+        return D3DERR_WASSTILLDRAWING;
+
+    if (!This->max_frame_latency)
+    {
+        QueryPerformanceCounter(&counter);
+        This->last_present_qpc = counter.QuadPart;
+    }
+    return D3D_OK;
+}
+
 static void free_d3dadapter_drawable(struct d3d_drawable *d3d)
 {
     ReleaseDC(d3d->wnd, d3d->hdc);
@@ -748,6 +856,43 @@ static ULONG WINAPI DRIPresent_AddRef(struct DRIPresent *This)
     return refs;
 }
 
+static void trace_present_statistics(struct DRIPresent *This)
+{
+    UINT replaced, skipped, capabilities, options;
+    struct PRESENTTimings timings;
+    uint64_t duration;
+
+    PRESENTGetTimings(This->present_priv, &timings);
+    duration = timings.last_present - timings.first_present;
+    if (timings.presents > 1 && duration)
+        TRACE("%u presents, %.1f per second, %lluus average in PRESENTPixmap\n",
+              timings.presents, (timings.presents - 1) * 1000000.0 / duration,
+              (unsigned long long)(timings.present_time / timings.presents));
+    if (timings.releases)
+        TRACE("Release latency: %lluus average, %lluus max\n",
+              (unsigned long long)(timings.release_time / timings.releases),
+              (unsigned long long)timings.release_time_max);
+    if (timings.window_changes)
+        TRACE("%u window changes, %u missed the cache, %lluus average\n",
+              timings.window_changes, timings.window_registers,
+              (unsigned long long)(timings.window_change_time / timings.window_changes));
+    if (timings.events)
+        TRACE("%u Present events, %lluns average to handle\n", timings.events,
+              (unsigned long long)(timings.event_time / timings.events));
+    if (timings.wait_timeouts)
+        TRACE("%u waits for Present events timed out, %u presents were given up\n",
+              timings.wait_timeouts, timings.lost_presents);
+
+    if (This->present_mailbox)
+    {
+        PRESENTGetSkipCounters(This->present_priv, &replaced, &skipped);
+        TRACE("Mailbox presents: %u replaced a queued frame, %u frames skipped\n",
+              replaced, skipped);
+    }
+    if (PRESENTGetPresentMode(This->present_priv, &capabilities, &options))
+        TRACE("Present capabilities %#x, last options %#x\n", capabilities, options);
+}
+
 static ULONG WINAPI DRIPresent_Release(struct DRIPresent *This)
 {
     ULONG refs = InterlockedDecrement(&This->refs);
@@ -759,6 +904,7 @@ static ULONG WINAPI DRIPresent_Release(struct DRIPresent *This)
         if (This->d3d)
             destroy_d3dadapter_drawable(This->gdi_display, This->d3d->wnd);
         set_display_mode(This, &This->initial_mode);
+        trace_present_statistics(This);
         PRESENTDestroy(This->present_priv);
         This->dri_backend->funcs->deinit(This->dri_backend->priv);
         HeapFree(GetProcessHeap(), 0, This);
@@ -991,7 +1137,14 @@ static HRESULT WINAPI DRIPresent_DestroyD3DWindowBuffer(struct DRIPresent *This,
      * But if it can delete it right away, we may have
      * better performance */
     //TRACE("This=%p buffer=%p of priv %p\n", This, buffer, buffer->present_pixmap_priv);
-    PRESENTTryFreePixmap(buffer->present_pixmap_priv);
+    if (!PRESENTTryFreePixmap(buffer->present_pixmap_priv) && TRACE_ON())
+    {
+        UINT count;
+        DWORD age;
+
+        PRESENTGetDeferredFrees(This->present_priv, &count, &age);
+        TRACE("%u pixmaps waiting to be freed, the oldest for %u ms\n", count, (UINT)age);
+    }
     dri_backend->funcs->destroy_pixmap(dri_backend->priv, buffer->priv);
     HeapFree(GetProcessHeap(), 0, buffer);
     return D3D_OK;
@@ -1030,6 +1183,23 @@ static HRESULT WINAPI DRIPresent_PresentBuffer( struct DRIPresent *This,
     RECT windowRect;
     RECT offset;
     HWND hwnd;
+    BOOL present_async, present_copy;
+    struct PRESENTGeometry geom;
+    HRESULT hr;
+
+    hr = wait_frame_latency(This, Flags);
+    if (FAILED(hr))
+        return hr;
+
+    /* Like GLX_EXT_swap_control_tear: once a frame missed its vblank,
+     * show the next one right away instead of halving the framerate */
+    present_async = This->present_async;
+    if (This->adaptive_vsync && This->present_interval && !present_async &&
+            PRESENTIsLate(This->present_priv))
+    {
+        TRACE("Late frame, presenting async\n");
+        present_async = TRUE;
+    }
 
     if (hWndOverride)
         hwnd = hWndOverride;
@@ -1056,13 +1226,15 @@ static HRESULT WINAPI DRIPresent_PresentBuffer( struct DRIPresent *This,
      * would be to catch any window related change with a
      * listener. But it is complicated and this heuristic
      * is fast and should work well. */
-    if (PRESENTGeomUpdated(This->present_priv) ||
+    PRESENTGetGeometry(This->present_priv, &geom);
+    if (geom.generation != This->geom_generation ||
         windowRect.top != d3d->windowRect.top ||
         windowRect.left != d3d->windowRect.left ||
         windowRect.bottom != d3d->windowRect.bottom ||
         windowRect.right != d3d->windowRect.right)
     {
         d3d->windowRect = windowRect;
+        This->geom_generation = geom.generation;
         get_drawable_offset(This->gdi_display, d3d);
     }
 
@@ -1094,12 +1266,23 @@ static HRESULT WINAPI DRIPresent_PresentBuffer( struct DRIPresent *This,
         return D3DERR_DRIVERINTERNALERROR;
     }
 
+    /* Copies are forced at interval 0 so that the server doesn't hold
+     * buffers the application waits for. An async flip holds only the
+     * buffer on screen, the next flip releases it right away: with two
+     * back buffers or more, one is always free to render to. */
+    present_copy = This->present_swapeffectcopy;
+    if (present_copy && present_async && This->present_interval == 0 &&
+            This->params.SwapEffect != D3DSWAPEFFECT_COPY &&
+            This->params.BackBufferCount >= 2 &&
+            PRESENTHasAsyncFlip(This->present_priv))
+        present_copy = FALSE;
+
     /* FIMXE: Do we need to aquire present mutex here? */
     dri_backend->funcs->present_pixmap(dri_backend->priv, buffer->priv);
 
     if (!PRESENTPixmap(d3d->drawable, buffer->present_pixmap_priv,
-            This->present_interval, This->present_async, This->present_swapeffectcopy,
-            pSourceRect, pDestRect, pDirtyRegion))
+            This->present_interval, present_async, This->present_mailbox,
+            present_copy, pSourceRect, pDestRect, pDirtyRegion))
     {
         release_d3d_drawable(d3d);
         TRACE("Present call failed\n");
@@ -1117,12 +1300,10 @@ static HRESULT WINAPI DRIPresent_GetRasterStatus( struct DRIPresent *This,
     LONGLONG freq_per_frame, freq_per_line;
     LARGE_INTEGER counter, freq_per_sec;
     unsigned refresh_rate, height;
+    uint64_t elapsed, period;
 
     TRACE("This=%p, pRasterStatus=%p\n", This, pRasterStatus);
 
-    if (!QueryPerformanceCounter(&counter) || !QueryPerformanceFrequency(&freq_per_sec))
-        return D3DERR_INVALIDCALL;
-
     if (This->params.Windowed)
     {
         refresh_rate = This->initial_mode.dmDisplayFrequency;
@@ -1134,6 +1315,30 @@ static HRESULT WINAPI DRIPresent_GetRasterStatus( struct DRIPresent *This,
         height = This->params.BackBufferHeight;
     }
 
+    /* The ust of a vblank is when the scanout of the frame starts,
+     * the blank is at the end of the period. Still assume 20 scan
+     * lines in the vertical blank. */
+    if (PRESENTGetVBlankPhase(This->present_priv, &elapsed, &period))
+    {
+        pRasterStatus->ScanLine = elapsed * (height + 20) / period;
+        if (pRasterStatus->ScanLine < height)
+            pRasterStatus->InVBlank = FALSE;
+        else
+        {
+            pRasterStatus->ScanLine = 0;
+            pRasterStatus->InVBlank = TRUE;
+        }
+
+        TRACE("period=%lluus, elapsed=%lluus, InVBlank %u, ScanLine %u.\n",
+              (unsigned long long)period, (unsigned long long)elapsed,
+              pRasterStatus->InVBlank, pRasterStatus->ScanLine);
+
+        return D3D_OK;
+    }
+
+    if (!QueryPerformanceCounter(&counter) || !QueryPerformanceFrequency(&freq_per_sec))
+        return D3DERR_INVALIDCALL;
+
     if (refresh_rate == 0)
         refresh_rate = 60;
 
@@ -1197,10 +1402,48 @@ static HRESULT WINAPI DRIPresent_GetDisplayMode( struct DRIPresent *This,
     return D3D_OK;
 }
 
+/* Convert a Present UST (CLOCK_MONOTONIC in microseconds) to the QPC timebase */
+static LONGLONG ust_to_qpc(uint64_t ust)
+{
+    LARGE_INTEGER counter, freq;
+    struct timespec ts;
+    int64_t now;
+
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&freq);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+    return counter.QuadPart - (now - (int64_t)ust) * freq.QuadPart / 1000000;
+}
+
 static HRESULT WINAPI DRIPresent_GetPresentStats( struct DRIPresent *This, D3DPRESENTSTATS *pStats )
 {
-    FIXME("(%p, %p), stub!\n", This, pStats);
-    return D3DERR_INVALIDCALL;
+    struct PRESENTStats stats;
+
+    if (!pStats)
+        return D3DERR_INVALIDCALL;
+
+    ZeroMemory(pStats, sizeof(*pStats));
+
+    /* Nothing displayed yet */
+    if (!PRESENTGetStats(This->present_priv, &stats))
+        return D3D_OK;
+
+    /* PresentRefreshCount is the refresh the last present was shown at,
+     * SyncRefreshCount the latest refresh seen and SyncQPCTime its time.
+     * There is no GPU clock to sample, the ust of the crtc is the closest. */
+    pStats->PresentCount = stats.present_count;
+    pStats->PresentRefreshCount = stats.msc;
+    pStats->SyncRefreshCount = stats.sync_msc;
+    pStats->SyncQPCTime.QuadPart = ust_to_qpc(stats.sync_ust);
+    pStats->SyncGPUTime.QuadPart = pStats->SyncQPCTime.QuadPart;
+
+    TRACE("PresentCount=%u, PresentRefreshCount=%u, SyncRefreshCount=%u, SyncQPCTime=%lld\n",
+          pStats->PresentCount, pStats->PresentRefreshCount, pStats->SyncRefreshCount,
+          (long long)pStats->SyncQPCTime.QuadPart);
+
+    return D3D_OK;
 }
 
 static HRESULT WINAPI DRIPresent_GetCursorPos( struct DRIPresent *This, POINT *pPoint )
@@ -1458,6 +1701,9 @@ static HRESULT present_create(Display *gdi_display, const WCHAR *devname,
     This->ex = ex;
     This->no_window_changes = no_window_changes;
     This->dri_backend = dri_backend;
+    This->max_frame_latency = get_max_frame_latency();
+    This->adaptive_vsync = get_adaptive_vsync();
+    This->frame_latency = DEFAULT_MAX_FRAME_LATENCY;
 
     /* store current resolution */
     ZeroMemory(&(This->initial_mode), sizeof(This->initial_mode));
@@ -0,0 +1,118 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Recorder of the Present requests and events
+ */
+
+#include <windows.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../common/debug.h"
+#include "../common/registry.h"
+#include "present_record.h"
+
+struct present_record_header *present_record_log;
+
+static BOOL present_record_initialized;
+static CRITICAL_SECTION present_record_section;
+static CRITICAL_SECTION_DEBUG present_record_section_debug =
+{
+    0, 0, &present_record_section,
+    { &present_record_section_debug.ProcessLocksList, &present_record_section_debug.ProcessLocksList },
+      0, 0, { /*(DWORD_PTR)(__FILE__ ": present_record_section")*/ }
+};
+static CRITICAL_SECTION present_record_section = { &present_record_section_debug, -1, 0, 0, 0, 0 };
+
+static uint64_t present_record_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static struct present_record_header *present_record_open(const char *path)
+{
+    struct present_record_header *header;
+    size_t size;
+    int fd;
+
+    size = sizeof(*header) + PRESENT_RECORD_CAPACITY * sizeof(struct present_record);
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        ERR("Failed to open the present record '%s'\n", path);
+        return NULL;
+    }
+
+    if (ftruncate(fd, size))
+    {
+        ERR("Failed to resize the present record '%s'\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED)
+    {
+        ERR("Failed to map the present record '%s'\n", path);
+        return NULL;
+    }
+
+    header->magic = PRESENT_RECORD_MAGIC;
+    header->version = PRESENT_RECORD_VERSION;
+    header->record_size = sizeof(struct present_record);
+    header->capacity = PRESENT_RECORD_CAPACITY;
+    header->count = 0;
+    header->start = present_record_now();
+    return header;
+}
+
+void present_record_init(void)
+{
+    const char *env;
+    char *reg = NULL;
+
+    EnterCriticalSection(&present_record_section);
+    if (present_record_initialized)
+    {
+        LeaveCriticalSection(&present_record_section);
+        return;
+    }
+    present_record_initialized = TRUE;
+
+    env = getenv("D3D_PRESENT_RECORD");
+    if (!env && common_get_registry_setting("PresentRecord", &reg))
+        env = reg;
+
+    if (env && *env)
+    {
+        /* The log is never unmapped, it must survive crashes */
+        present_record_log = present_record_open(env);
+        if (present_record_log)
+            WARN("Recording presents to '%s'\n", env);
+    }
+
+    HeapFree(GetProcessHeap(), 0, reg);
+    LeaveCriticalSection(&present_record_section);
+}
+
+void present_record_write(struct present_record *record)
+{
+    struct present_record_header *header = present_record_log;
+    struct present_record *records = (struct present_record *)(header + 1);
+    uint32_t index;
+
+    index = InterlockedIncrement((LONG *)&header->count) - 1;
+    record->time = present_record_now();
+    record->seq = 0;
+    records[index % PRESENT_RECORD_CAPACITY] = *record;
+    /* The reader skips records being written */
+    MemoryBarrier();
+    records[index % PRESENT_RECORD_CAPACITY].seq = index + 1;
+}
@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Recorder of the Present requests and events
+ *
+ * The log is a memory-mapped file: a header followed by a ring of
+ * fixed size records. It is read by tools/present-replay.c, so this
+ * header must not depend on wine or X headers. 32 and 64 bit builds
+ * write the same layout: the structs are padded explicitly, as i386
+ * aligns uint64_t to 4 bytes only.
+ */
+
+#ifndef __NINE_PRESENT_RECORD_H
+#define __NINE_PRESENT_RECORD_H
+
+#include <stdint.h>
+
+#define PRESENT_RECORD_MAGIC   0x3152504e /* "NPR1" */
+#define PRESENT_RECORD_VERSION 2
+/* Records kept, older ones are overwritten */
+#define PRESENT_RECORD_CAPACITY 65536
+
+enum present_record_type
+{
+    PRESENT_RECORD_PIXMAP = 1, /* PresentPixmap sent */
+    PRESENT_RECORD_COMPLETE,   /* CompleteNotify received */
+    PRESENT_RECORD_IDLE,       /* IdleNotify received */
+    PRESENT_RECORD_ERROR,      /* PresentPixmap failed */
+};
+
+struct present_record_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t capacity;
+    uint32_t count; /* records written so far, the last is at (count - 1) % capacity */
+    uint32_t pad;
+    uint64_t start; /* CLOCK_MONOTONIC in microseconds, like the ust */
+};
+
+struct present_record
+{
+    uint64_t time; /* of the submission or of the event handling, CLOCK_MONOTONIC in microseconds */
+    uint64_t msc;  /* target msc of a PIXMAP, msc of the events */
+    uint64_t ust;  /* COMPLETE only */
+    uint32_t window;
+    uint32_t serial;
+    uint32_t options; /* PresentOption of a PIXMAP */
+    uint32_t seq; /* index of the record + 1, written last */
+    int16_t x, y; /* bounding box of the update region of a PIXMAP */
+    uint16_t width, height;
+    uint8_t type; /* enum present_record_type */
+    uint8_t kind; /* PresentCompleteKind of a COMPLETE */
+    uint8_t mode; /* PresentCompleteMode of a COMPLETE */
+    uint8_t nrects; /* of the update region of a PIXMAP */
+    uint32_t pad;
+};
+
+_Static_assert(sizeof(struct present_record_header) == 32, "present_record_header layout");
+_Static_assert(sizeof(struct present_record) == 56, "present_record layout");
+
+#ifndef PRESENT_RECORD_FORMAT_ONLY
+
+/* Opens the log named by D3D_PRESENT_RECORD or the PresentRecord setting, once */
+void present_record_init(void);
+
+/* Non-NULL when recording, cheap enough to test before filling a record */
+extern struct present_record_header *present_record_log;
+
+/* Stamps the record with the time and appends it to the log */
+void present_record_write(struct present_record *record);
+
+#endif
+
+#endif /* __NINE_PRESENT_RECORD_H */
@@ -9,17 +9,114 @@
 #include <windows.h>
 #include <X11/Xlib-xcb.h>
 #include <xcb/present.h>
+#ifdef D3D9NINE_XSHMFENCE
+#include <X11/xshmfence.h>
+#include <xcb/sync.h>
+#endif
+#include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "../common/debug.h"
+#include "present_record.h"
 #include "xcb_present.h"
 
-struct PRESENTPriv {
-    xcb_connection_t *xcb_connection;
+/* Dirty regions simplified to more rectangles are sent as their bounding box */
+#define PRESENT_MAX_UPDATE_RECTS 64
+/* Dirty regions with more rectangles aren't simplified, but sent as their bounding box */
+#define PRESENT_MAX_DIRTY_RECTS 256
+/* Number of displayed presents kept for statistics */
+#define PRESENT_STATS_RING_SIZE 16
+/* Number of vblank timestamps kept to model the refresh of the crtc */
+#define PRESENT_VBLANK_RING_SIZE 16
+/* Age in microseconds after which the vblank model gets a new timestamp */
+#define PRESENT_VBLANK_MAX_AGE 1000000
+/* Windows kept registered for Present events, to switch between them cheaply */
+#define PRESENT_WINDOW_CACHE_SIZE 4
+/* X errors kept until a PRESENTpriv claims them */
+#define PRESENT_MAX_PENDING_ERRORS 64
+/* Failed presents kept until they are logged, more are only counted */
+#define PRESENT_MAX_ERROR_REPORTS 8
+/* Time in ms Present events may be overdue before PRESENTresync */
+#define PRESENT_WAIT_TIMEOUT 100
+/* Time in ms between two checks of an idle fence */
+#define PRESENT_FENCE_POLL_INTERVAL 1
+/* Time in ms after which a present overdue without its events is given up */
+#define PRESENT_LOST_TIMEOUT 1000
+/* Refreshes the msc of the window must be past the target of a present to give it up */
+#define PRESENT_LOST_REFRESHES 4
+/* Refresh period in microseconds assumed until it is measured: the fake
+ * crtc of the server, used without monitor or with DPMS, runs at 1 Hz */
+#define PRESENT_DEFAULT_REFRESH_PERIOD 1000000
+/* fds handled per epoll_wait() of the event thread */
+#define PRESENT_MAX_EPOLL_EVENTS 16
+
+/* The X connections are shared by all PRESENTpriv of a display.
+ * Lock order: connection_pool_section, reactor_section, dispatch_lock,
+ * mutex_present of a PRESENTpriv, errors_lock. */
+struct PRESENTConnection {
+    struct PRESENTConnection *next;
+    char *display_name;
+    unsigned refs; /* protected by connection_pool_section */
+    xcb_connection_t *xcb_connection; /* Present events, only read by the event thread */
     xcb_connection_t *xcb_connection_bis; /* to avoid libxcb thread bugs, use a different connection to present pixmaps */
-    XID window;
+    CRITICAL_SECTION dispatch_lock; /* held by the event thread while handling events */
+    PRESENTpriv **privs; /* registered PRESENTpriv, protected by dispatch_lock */
+    unsigned privs_count;
+    unsigned privs_size;
+    struct PRESENTReactor *reactor; /* waiting for the events of both connections */
+    BOOL event_thread_error; /* no more events will be handled */
+    CRITICAL_SECTION errors_lock;
+    xcb_generic_error_t *errors[PRESENT_MAX_PENDING_ERRORS]; /* of xcb_connection_bis, oldest first */
+    unsigned errors_count;
+};
+
+static struct PRESENTConnection *connection_pool;
+static UINT connection_pool_count; /* X connections open */
+static CRITICAL_SECTION connection_pool_section;
+static CRITICAL_SECTION_DEBUG connection_pool_section_debug =
+{
+    0, 0, &connection_pool_section,
+    { &connection_pool_section_debug.ProcessLocksList, &connection_pool_section_debug.ProcessLocksList },
+      0, 0, { /*(DWORD_PTR)(__FILE__ ": connection_pool_section")*/ }
+};
+static CRITICAL_SECTION connection_pool_section = { &connection_pool_section_debug, -1, 0, 0, 0, 0 };
+
+/* A single event thread waits for the X connections of the whole process.
+ * It runs while there is at least one connection. */
+struct PRESENTReactor {
+    HANDLE thread;
+    int epoll_fd;
+    int wakeup[2]; /* pipe to interrupt epoll_wait() */
+    BOOL quit;
+    struct PRESENTConnection **connections; /* protected by reactor_section */
+    unsigned connections_count;
+    unsigned connections_size;
+};
+
+static struct PRESENTReactor *reactor; /* the running one, protected by reactor_section */
+static CRITICAL_SECTION reactor_section;
+static CRITICAL_SECTION_DEBUG reactor_section_debug =
+{
+    0, 0, &reactor_section,
+    { &reactor_section_debug.ProcessLocksList, &reactor_section_debug.ProcessLocksList },
+      0, 0, { /*(DWORD_PTR)(__FILE__ ": reactor_section")*/ }
+};
+static CRITICAL_SECTION reactor_section = { &reactor_section_debug, -1, 0, 0, 0, 0 };
+
+/* msc and ust of a refresh of the crtc */
+struct PRESENTVblank {
+    uint64_t msc;
+    uint64_t ust;
+};
+
+struct PRESENTWindow {
+    XID window; /* 0 for an unused entry */
+    xcb_special_event_t *special_event;
+    xcb_present_event_t event_id;
     uint64_t last_msc;
     uint64_t last_target;
     int16_t last_x; /* Position of window relative to its parent */
@@ -27,28 +124,102 @@ struct PRESENTPriv {
     uint16_t last_width; /* window size */
     uint16_t last_height;
     unsigned last_depth;
-    LONG win_updated; /* Window received a config notify event */
-    xcb_special_event_t *special_event;
-    PRESENTPixmapPriv *first_present_priv;
+    int present_pending; /* presents to this window without complete event */
+    unsigned last_use;
+    uint32_t capabilities; /* of the crtc showing the window */
+    unsigned int capabilities_sequence; /* QueryCapabilities in flight on xcb_connection_bis */
+    uint32_t last_options; /* of the last present */
+    PRESENTPixmapPriv *flip_pixmap; /* last flipped, the server may still show it */
+};
+
+/* A failed present, taken when its error is handled and logged later
+ * by PRESENTreport_errors, which needs a round trip */
+struct PRESENTErrorReport {
+    uint32_t serial;
+    XID window;
+    unsigned int width; /* of the pixmap */
+    unsigned int height;
+    unsigned int depth;
+    UINT interval;
+    int pending; /* presents pending when it was sent */
+    uint8_t error_code;
+    uint8_t major_code;
+    uint16_t minor_code;
+};
+
+struct PRESENTPriv {
+    struct PRESENTConnection *connection;
+    xcb_connection_t *xcb_connection; /* shortcuts to the connections of connection */
+    xcb_connection_t *xcb_connection_bis;
+    XID window; /* window of current */
+    struct PRESENTWindow *current;
+    struct PRESENTWindow windows[PRESENT_WINDOW_CACHE_SIZE];
+    unsigned window_use_count;
+    /* geometry of current for readers without lock: odd geom_seq while it is written */
+    LONG geom_seq;
+    struct PRESENTGeometry geom;
+    PRESENTPixmapPriv **pixmap_table; /* open addressing, indexed by serial */
+    unsigned pixmap_table_size; /* power of two */
+    unsigned pixmap_table_count;
     int pixmap_present_pending;
     BOOL idle_notify_since_last_check;
-    BOOL notify_with_serial_pending;
     CRITICAL_SECTION mutex_present; /* protect readind/writing present_priv things */
-    CRITICAL_SECTION mutex_xcb_wait;
-    BOOL xcb_wait;
+    CONDITION_VARIABLE event_cond; /* signaled for every event handled */
+    BOOL event_thread_error; /* no more events will be handled */
+    /* regions of xcb_connection_bis reused by PRESENTPixmap and their current content */
+    xcb_xfixes_region_t valid_region;
+    xcb_xfixes_region_t update_region;
+    xcb_rectangle_t valid_rect;
+    unsigned valid_nrects;
+    xcb_rectangle_t update_rects[PRESENT_MAX_UPDATE_RECTS];
+    unsigned update_nrects;
+    UINT present_count; /* presents sent */
+    struct PRESENTStats stats_ring[PRESENT_STATS_RING_SIZE];
+    unsigned stats_count; /* presents displayed, the last is at stats_count - 1 */
+    UINT mailbox_replaced; /* mailbox presents sent while another one was queued */
+    UINT skipped_count; /* presents the server never displayed */
+    BOOL last_present_late; /* the last displayed present missed its target msc */
+    UINT deferred_free_count; /* pixmaps with free_pending */
+    uint64_t vblank_request_time; /* PRESENTnow() of the last NotifyMSC */
+    /* refreshes of the crtc, from the CompleteNotify events of both presents and NotifyMSC */
+    struct PRESENTVblank vblank_ring[PRESENT_VBLANK_RING_SIZE];
+    unsigned vblank_count; /* the last is at vblank_count - 1 */
+    struct PRESENTTimings timings;
+    uint64_t last_event_time; /* PRESENTnow() of the last Present event handled */
+    uint64_t last_resync_time; /* PRESENTnow() of the last PRESENTresync */
+    uint64_t events_expected; /* PRESENTnow() at which all requested events should have come */
+    struct PRESENTErrorReport error_reports[PRESENT_MAX_ERROR_REPORTS]; /* not logged yet */
+    unsigned error_reports_count;
+    UINT error_reports_lost; /* failed presents that didn't fit in error_reports */
 };
 
 struct PRESENTPixmapPriv {
     PRESENTpriv *present_priv;
     Pixmap pixmap;
-    BOOL released;
+    LONG released; /* written with mutex_present held and Interlocked, see PRESENTIsPixmapReleased */
     unsigned int width;
     unsigned int height;
     unsigned int depth;
     unsigned int present_complete_pending;
     uint32_t serial;
     BOOL last_present_was_flip;
-    PRESENTPixmapPriv *next;
+    /* the present in flight, to match asynchronous errors */
+    unsigned int present_sequence;
+    XID present_window;
+    UINT present_interval;
+    int present_pending;
+    UINT present_count;
+    uint64_t present_target_msc;
+    uint32_t present_options;
+    uint64_t present_time; /* of the present not released yet, for PRESENTTimings */
+    uint64_t present_expected; /* PRESENTnow() at which the present should complete */
+    BOOL resync_copy_sent; /* by PRESENTresync, for the present in flight */
+    /* triggered by the server when it releases the pixmap, see PRESENTPixmapSetIdleFence */
+    XID idle_fence;
+    struct xshmfence *idle_fence_shm;
+    BOOL free_pending; /* PRESENTTryFreePixmap failed, free once released */
+    ULONGLONG free_time; /* GetTickCount64() of the failed PRESENTTryFreePixmap */
+    CONDITION_VARIABLE released_cond; /* signaled when released or present_complete_pending changes */
 };
 
 static xcb_screen_t *screen_of_display(xcb_connection_t *c,
@@ -64,10 +235,10 @@ static xcb_screen_t *screen_of_display(xcb_connection_t *c,
   return NULL;
 }
 
+static LONG last_serial_given = 0;
+
 LONG PRESENTGetNewSerial(void)
 {
-    static LONG last_serial_given = 0;
-
     return InterlockedIncrement(&last_serial_given);
 }
 
@@ -106,32 +277,382 @@ BOOL PRESENTCheckExtension(Display *dpy, int major, int minor)
     return TRUE;
 }
 
+/* Serials are handed out sequentially, so using the low bits as hash
+ * spreads live pixmaps evenly over the table and keeps probe sequences
+ * short. The table is kept at most half full. */
 static PRESENTPixmapPriv *PRESENTFindPixmapPriv(PRESENTpriv *present_priv, uint32_t serial)
 {
-    PRESENTPixmapPriv *current = present_priv->first_present_priv;
+    unsigned mask = present_priv->pixmap_table_size - 1;
+    unsigned i;
+
+    if (!present_priv->pixmap_table_size)
+        return NULL;
+
+    for (i = serial & mask; present_priv->pixmap_table[i]; i = (i + 1) & mask)
+    {
+        if (present_priv->pixmap_table[i]->serial == serial)
+            return present_priv->pixmap_table[i];
+    }
+    return NULL;
+}
+
+static void PRESENTPixmapTableSet(PRESENTPixmapPriv **table, unsigned size,
+        PRESENTPixmapPriv *present_pixmap_priv)
+{
+    unsigned i = present_pixmap_priv->serial & (size - 1);
+
+    while (table[i])
+        i = (i + 1) & (size - 1);
+    table[i] = present_pixmap_priv;
+}
+
+static BOOL PRESENTPixmapTableInsert(PRESENTpriv *present_priv, PRESENTPixmapPriv *present_pixmap_priv)
+{
+    if ((present_priv->pixmap_table_count + 1) * 2 > present_priv->pixmap_table_size)
+    {
+        unsigned size = present_priv->pixmap_table_size ? present_priv->pixmap_table_size * 2 : 16;
+        PRESENTPixmapPriv **table;
+        unsigned i;
+
+        table = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, size * sizeof(*table));
+        if (!table)
+            return FALSE;
+
+        for (i = 0; i < present_priv->pixmap_table_size; i++)
+        {
+            if (present_priv->pixmap_table[i])
+                PRESENTPixmapTableSet(table, size, present_priv->pixmap_table[i]);
+        }
+        HeapFree(GetProcessHeap(), 0, present_priv->pixmap_table);
+        present_priv->pixmap_table = table;
+        present_priv->pixmap_table_size = size;
+    }
+
+    PRESENTPixmapTableSet(present_priv->pixmap_table, present_priv->pixmap_table_size,
+            present_pixmap_priv);
+    present_priv->pixmap_table_count++;
+    return TRUE;
+}
+
+static void PRESENTPixmapTableRemove(PRESENTpriv *present_priv, PRESENTPixmapPriv *present_pixmap_priv)
+{
+    PRESENTPixmapPriv **table = present_priv->pixmap_table;
+    unsigned mask = present_priv->pixmap_table_size - 1;
+    unsigned i, j, home;
+
+    for (i = present_pixmap_priv->serial & mask; table[i] != present_pixmap_priv; i = (i + 1) & mask);
+
+    /* Backward shift deletion: move up entries of the same probe sequence
+     * so that lookups never need tombstones. */
+    for (j = (i + 1) & mask; table[j]; j = (j + 1) & mask)
+    {
+        home = table[j]->serial & mask;
+        if (((j - home) & mask) >= ((j - i) & mask))
+        {
+            table[i] = table[j];
+            i = j;
+        }
+    }
+    table[i] = NULL;
+    present_priv->pixmap_table_count--;
+}
+
+static uint64_t PRESENTnow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Event handling takes less than a microsecond */
+static uint64_t PRESENTnow_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Must be called with mutex_present held, when the server released the pixmap */
+static void PRESENTaccount_release(PRESENTpriv *present_priv, PRESENTPixmapPriv *present_pixmap_priv)
+{
+    uint64_t latency;
+
+    if (!present_pixmap_priv->present_time)
+        return;
+    latency = PRESENTnow() - present_pixmap_priv->present_time;
+    present_pixmap_priv->present_time = 0;
+    present_priv->timings.releases++;
+    present_priv->timings.release_time += latency;
+    if (latency > present_priv->timings.release_time_max)
+        present_priv->timings.release_time_max = latency;
+}
+
+#ifdef D3D9NINE_XSHMFENCE
+static void PRESENTfence_reset(PRESENTPixmapPriv *present_pixmap_priv)
+{
+    if (present_pixmap_priv->idle_fence_shm)
+        xshmfence_reset(present_pixmap_priv->idle_fence_shm);
+}
+
+/* For releases the server won't signal */
+static void PRESENTfence_trigger(PRESENTPixmapPriv *present_pixmap_priv)
+{
+    if (present_pixmap_priv->idle_fence_shm)
+        xshmfence_trigger(present_pixmap_priv->idle_fence_shm);
+}
+
+static BOOL PRESENTfence_query(PRESENTPixmapPriv *present_pixmap_priv)
+{
+    return present_pixmap_priv->idle_fence_shm &&
+           xshmfence_query(present_pixmap_priv->idle_fence_shm);
+}
+
+static void PRESENTfence_destroy(PRESENTpriv *present_priv, PRESENTPixmapPriv *present_pixmap_priv)
+{
+    if (!present_pixmap_priv->idle_fence_shm)
+        return;
+    xcb_sync_destroy_fence(present_priv->xcb_connection_bis, present_pixmap_priv->idle_fence);
+    xshmfence_unmap_shm(present_pixmap_priv->idle_fence_shm);
+}
+#else
+static void PRESENTfence_reset(PRESENTPixmapPriv *present_pixmap_priv) {}
+static void PRESENTfence_trigger(PRESENTPixmapPriv *present_pixmap_priv) {}
+static BOOL PRESENTfence_query(PRESENTPixmapPriv *present_pixmap_priv) { return FALSE; }
+static void PRESENTfence_destroy(PRESENTpriv *present_priv, PRESENTPixmapPriv *present_pixmap_priv) {}
+#endif
+
+/* Must be called with mutex_present held.
+ * Marks the pixmap released once its idle fence is triggered. */
+static BOOL PRESENTcheck_fence(PRESENTpriv *present_priv, PRESENTPixmapPriv *present_pixmap_priv)
+{
+    if (present_pixmap_priv->released || !PRESENTfence_query(present_pixmap_priv))
+        return present_pixmap_priv->released;
+
+    /* The IdleNotify event of this release is still to come, it is ignored */
+    InterlockedExchange(&present_pixmap_priv->released, TRUE);
+    PRESENTaccount_release(present_priv, present_pixmap_priv);
+    present_priv->idle_notify_since_last_check = TRUE;
+    return TRUE;
+}
+
+/* Must be called with mutex_present held */
+static void PRESENTrecord_vblank(PRESENTpriv *present_priv, uint64_t msc, uint64_t ust)
+{
+    struct PRESENTVblank *last;
+
+    if (present_priv->vblank_count)
+    {
+        last = &present_priv->vblank_ring[(present_priv->vblank_count - 1) % PRESENT_VBLANK_RING_SIZE];
+        if (msc == last->msc)
+            return;
+        /* Another crtc, or its counter was reset */
+        if (msc < last->msc || ust <= last->ust)
+            present_priv->vblank_count = 0;
+    }
+    present_priv->vblank_ring[present_priv->vblank_count++ % PRESENT_VBLANK_RING_SIZE] =
+            (struct PRESENTVblank){ msc, ust };
+}
+
+static void PRESENTrecord_event(uint8_t type, uint32_t window, uint32_t serial,
+        uint8_t kind, uint8_t mode, uint64_t msc, uint64_t ust)
+{
+    struct present_record record;
+
+    memset(&record, 0, sizeof(record));
+    record.type = type;
+    record.window = window;
+    record.serial = serial;
+    record.kind = kind;
+    record.mode = mode;
+    record.msc = msc;
+    record.ust = ust;
+    present_record_write(&record);
+}
+
+/* Must be called with mutex_present held, after PRESENTUpdateRegion */
+static void PRESENTrecord_pixmap(PRESENTpriv *present_priv, PRESENTPixmapPriv *present_pixmap_priv,
+        XID window, xcb_xfixes_region_t update, uint64_t target_msc, uint32_t options)
+{
+    struct present_record record;
+    RECT bounds, rc;
+    unsigned i;
+
+    memset(&record, 0, sizeof(record));
+    record.type = PRESENT_RECORD_PIXMAP;
+    record.window = window;
+    record.serial = present_pixmap_priv->serial;
+    record.options = options;
+    record.msc = target_msc;
+
+    SetRect(&bounds, 0, 0, present_pixmap_priv->width, present_pixmap_priv->height);
+    if (update)
+    {
+        SetRectEmpty(&bounds);
+        for (i = 0; i < present_priv->update_nrects; i++)
+        {
+            SetRect(&rc, present_priv->update_rects[i].x, present_priv->update_rects[i].y,
+                    present_priv->update_rects[i].x + present_priv->update_rects[i].width,
+                    present_priv->update_rects[i].y + present_priv->update_rects[i].height);
+            UnionRect(&bounds, &bounds, &rc);
+        }
+        record.nrects = present_priv->update_nrects;
+    }
+    record.x = bounds.left;
+    record.y = bounds.top;
+    record.width = bounds.right - bounds.left;
+    record.height = bounds.bottom - bounds.top;
+    present_record_write(&record);
+}
+
+static void PRESENTDestroyPixmapContent(PRESENTPixmapPriv *present_pixmap);
+
+/* Must be called with mutex_present held */
+static void PRESENTfree_pixmap(PRESENTpriv *present_priv, PRESENTPixmapPriv *present_pixmap_priv)
+{
+    unsigned i;
+
+    for (i = 0; i < PRESENT_WINDOW_CACHE_SIZE; i++)
+    {
+        if (present_priv->windows[i].flip_pixmap == present_pixmap_priv)
+            present_priv->windows[i].flip_pixmap = NULL;
+    }
+    PRESENTPixmapTableRemove(present_priv, present_pixmap_priv);
+    PRESENTDestroyPixmapContent(present_pixmap_priv);
+    xcb_flush(present_priv->xcb_connection_bis);
+    HeapFree(GetProcessHeap(), 0, present_pixmap_priv);
+}
+
+/* Must be called with mutex_present held.
+ * Frees a pixmap PRESENTTryFreePixmap couldn't free, once the server released it. */
+static void PRESENTdeferred_free(PRESENTpriv *present_priv, PRESENTPixmapPriv *present_pixmap_priv)
+{
+    if (!present_pixmap_priv->free_pending || !present_pixmap_priv->released ||
+        present_pixmap_priv->present_complete_pending)
+        return;
+
+    TRACE("Deferred free of pixmap priv %p after %u ms\n", present_pixmap_priv,
+          (unsigned)(GetTickCount64() - present_pixmap_priv->free_time));
+    present_priv->deferred_free_count--;
+    PRESENTfree_pixmap(present_priv, present_pixmap_priv);
+}
+
+static struct PRESENTWindow *PRESENTfind_window(PRESENTpriv *present_priv, XID window)
+{
+    unsigned i;
 
-    while (current)
+    for (i = 0; i < PRESENT_WINDOW_CACHE_SIZE; i++)
     {
-        if (current->serial == serial)
-            return current;
-        current = current->next;
+        if (window && present_priv->windows[i].window == window)
+            return &present_priv->windows[i];
     }
     return NULL;
 }
 
+/* Present a pixmap the server may hold for a flip again with a non-valid
+ * part, to force the copy mode and the release. Doesn't wait for anything. */
+static void PRESENTforce_copy(PRESENTpriv *present_priv, XID window, PRESENTPixmapPriv *present_pixmap_priv)
+{
+    xcb_xfixes_region_t valid, update;
+    xcb_rectangle_t rect_update;
+
+#ifdef D3D9NINE_PRESENT_REPLAY
+    /* PRESENTReplayLog has no X connection */
+    if (!present_priv->xcb_connection)
+        return;
+#endif
+    rect_update.x = 0;
+    rect_update.y = 0;
+    rect_update.width = 8;
+    rect_update.height = 1;
+    valid = xcb_generate_id(present_priv->xcb_connection);
+    update = xcb_generate_id(present_priv->xcb_connection);
+    xcb_xfixes_create_region(present_priv->xcb_connection, valid, 1, &rect_update);
+    xcb_xfixes_create_region(present_priv->xcb_connection, update, 1, &rect_update);
+    /* here we know the pixmap has been presented. Thus if it is on screen,
+     * the following request can only make it released by the server if it is not */
+    xcb_present_pixmap(present_priv->xcb_connection, window,
+            present_pixmap_priv->pixmap, 0, valid, update, 0, 0, None, None,
+            None, XCB_PRESENT_OPTION_COPY | XCB_PRESENT_OPTION_ASYNC, 0, 0, 0, 0, NULL);
+    xcb_xfixes_destroy_region(present_priv->xcb_connection, update);
+    xcb_xfixes_destroy_region(present_priv->xcb_connection, valid);
+    xcb_flush(present_priv->xcb_connection);
+}
+
+/* Must be called with mutex_present held.
+ * Asks for the capabilities of the window, PRESENTupdate_capabilities gets them later. */
+static void PRESENTrequest_capabilities(PRESENTpriv *present_priv, struct PRESENTWindow *win)
+{
+    if (win->capabilities_sequence)
+        return;
+
+    win->capabilities_sequence = xcb_present_query_capabilities(present_priv->xcb_connection_bis,
+            win->window).sequence;
+    xcb_flush(present_priv->xcb_connection_bis);
+}
+
+/* Must be called with mutex_present held. Doesn't wait for the reply. */
+static void PRESENTupdate_capabilities(PRESENTpriv *present_priv, struct PRESENTWindow *win)
+{
+    xcb_present_query_capabilities_reply_t *reply;
+    xcb_generic_error_t *error = NULL;
+
+    if (!win->capabilities_sequence ||
+        !xcb_poll_for_reply(present_priv->xcb_connection_bis, win->capabilities_sequence,
+                (void **) &reply, &error))
+        return;
+
+    win->capabilities_sequence = 0;
+    if (reply)
+    {
+        if (reply->capabilities != win->capabilities)
+            TRACE("Window %lx capabilities %#x -> %#x\n", (unsigned long)win->window,
+                  win->capabilities, reply->capabilities);
+        win->capabilities = reply->capabilities;
+        free(reply);
+    }
+    free(error);
+}
+
+/* Must be called with mutex_present held, the only writer */
+static void PRESENTpublish_geometry(PRESENTpriv *present_priv)
+{
+    struct PRESENTWindow *win = present_priv->current;
+    struct PRESENTGeometry *geom = &present_priv->geom;
+
+    InterlockedIncrement(&present_priv->geom_seq);
+    geom->window = win ? win->window : 0;
+    geom->x = win ? win->last_x : 0;
+    geom->y = win ? win->last_y : 0;
+    geom->width = win ? win->last_width : 0;
+    geom->height = win ? win->last_height : 0;
+    geom->depth = win ? win->last_depth : 0;
+    geom->generation++;
+    InterlockedIncrement(&present_priv->geom_seq);
+}
+
 static void PRESENThandle_events(PRESENTpriv *present_priv, xcb_present_generic_event_t *ge)
 {
+    struct PRESENTWindow *win;
+
     PRESENTPixmapPriv *present_pixmap_priv = NULL;
 
+    present_priv->last_event_time = PRESENTnow();
+
     switch (ge->evtype)
     {
         case XCB_PRESENT_COMPLETE_NOTIFY:
         {
             xcb_present_complete_notify_event_t *ce = (void *) ge;
+            if (present_record_log)
+                PRESENTrecord_event(PRESENT_RECORD_COMPLETE, ce->window, ce->serial,
+                        ce->kind, ce->mode, ce->msc, ce->ust);
             if (ce->kind == XCB_PRESENT_COMPLETE_KIND_NOTIFY_MSC)
             {
-                if (ce->serial)
-                    present_priv->notify_with_serial_pending = FALSE;
+                if ((win = PRESENTfind_window(present_priv, ce->window)))
+                    win->last_msc = ce->msc;
+                PRESENTrecord_vblank(present_priv, ce->msc, ce->ust);
                 free(ce);
                 return;
             }
@@ -142,6 +663,13 @@ static void PRESENThandle_events(PRESENTpriv *present_priv, xcb_present_generic_
                 free(ce);
                 return;
             }
+            if (!present_pixmap_priv->present_complete_pending)
+            {
+                /* PRESENTresync gave up on this present */
+                TRACE("Late complete event of serial %u\n", ce->serial);
+                free(ce);
+                return;
+            }
             present_pixmap_priv->present_complete_pending--;
             switch (ce->mode)
             {
@@ -152,13 +680,47 @@ static void PRESENThandle_events(PRESENTpriv *present_priv, xcb_present_generic_
                     present_pixmap_priv->last_present_was_flip = FALSE;
                     break;
             }
+            if (ce->mode == XCB_PRESENT_COMPLETE_MODE_SKIP)
+            {
+                present_priv->skipped_count++;
+                TRACE("Present of serial %u skipped at msc %llu\n",
+                      ce->serial, (unsigned long long)ce->msc);
+            }
+            else
+            {
+                struct PRESENTStats *stats;
+
+                stats = &present_priv->stats_ring[present_priv->stats_count++ % PRESENT_STATS_RING_SIZE];
+                stats->present_count = present_pixmap_priv->present_count;
+                stats->msc = ce->msc;
+                stats->ust = ce->ust;
+                present_priv->last_present_late = ce->msc > present_pixmap_priv->present_target_msc;
+                if (present_priv->last_present_late)
+                    present_priv->timings.late_presents++;
+                PRESENTrecord_vblank(present_priv, ce->msc, ce->ust);
+            }
             present_priv->pixmap_present_pending--;
-            present_priv->last_msc = ce->msc;
+            win = PRESENTfind_window(present_priv, ce->window);
+            if (win)
+            {
+                win->present_pending--;
+                win->last_msc = ce->msc;
+                if (ce->mode == XCB_PRESENT_COMPLETE_MODE_FLIP)
+                    win->flip_pixmap = present_pixmap_priv;
+                /* Nobody presents to this window anymore to release the pixmap */
+                if (win != present_priv->current && ce->mode == XCB_PRESENT_COMPLETE_MODE_FLIP)
+                    PRESENTforce_copy(present_priv, win->window, present_pixmap_priv);
+            }
+            present_pixmap_priv->present_sequence = 0;
+            WakeAllConditionVariable(&present_pixmap_priv->released_cond);
+            PRESENTdeferred_free(present_priv, present_pixmap_priv);
             break;
         }
         case XCB_PRESENT_EVENT_IDLE_NOTIFY:
         {
             xcb_present_idle_notify_event_t *ie = (void *) ge;
+            if (present_record_log)
+                PRESENTrecord_event(PRESENT_RECORD_IDLE, ie->window, ie->serial, 0, 0, 0, 0);
             present_pixmap_priv = PRESENTFindPixmapPriv(present_priv, ie->serial);
             if (!present_pixmap_priv || present_pixmap_priv->pixmap != ie->pixmap)
             {
@@ -166,310 +728,1154 @@ static void PRESENThandle_events(PRESENTpriv *present_priv, xcb_present_generic_
                 free(ie);
                 return;
             }
-            present_pixmap_priv->released = TRUE;
+            /* The release was already seen on the idle fence. The fence is
+             * reset by every present, so it also tells if the event is the
+             * late one of a present before the current one. */
+            if (present_pixmap_priv->released ||
+                (present_pixmap_priv->idle_fence_shm && !PRESENTfence_query(present_pixmap_priv)))
+                break;
+            InterlockedExchange(&present_pixmap_priv->released, TRUE);
+            PRESENTaccount_release(present_priv, present_pixmap_priv);
             present_priv->idle_notify_since_last_check = TRUE;
+            WakeAllConditionVariable(&present_pixmap_priv->released_cond);
+            PRESENTdeferred_free(present_priv, present_pixmap_priv);
             break;
         }
         case XCB_PRESENT_CONFIGURE_NOTIFY:
         {
             xcb_present_configure_notify_event_t *ce = (void *) ge;
-            if (present_priv->window == ce->window) {
-                present_priv->last_x = ce->x;
-                present_priv->last_y = ce->y;
-                present_priv->last_width = ce->width;
-                present_priv->last_height = ce->height;
+            win = PRESENTfind_window(present_priv, ce->window);
+            if (win) {
+                win->last_x = ce->x;
+                win->last_y = ce->y;
+                win->last_width = ce->width;
+                win->last_height = ce->height;
                 /* Configure notify events arrive for all changes: stack order, etc. Not just x/y/width/height changes */
-                present_priv->win_updated = TRUE;
+                if (win == present_priv->current)
+                    PRESENTpublish_geometry(present_priv);
+                /* The window may have moved to another crtc */
+                PRESENTrequest_capabilities(present_priv, win);
             }
             break;
         }
     }
     free(ge);
+    WakeAllConditionVariable(&present_priv->event_cond);
 }
 
-static void PRESENTflush_events(PRESENTpriv *present_priv, BOOL assert_no_other_thread_waiting)
+/* Must be called with mutex_present held */
+static void PRESENTadd_error_report(PRESENTpriv *present_priv, PRESENTPixmapPriv *present_pixmap_priv,
+        const xcb_generic_error_t *error)
 {
-    xcb_generic_event_t *ev;
-
-    if ((present_priv->xcb_wait && !assert_no_other_thread_waiting) || /* don't steal events to someone waiting */
-            !present_priv->special_event)
-        return;
+    struct PRESENTErrorReport *report;
 
-    while ((ev = xcb_poll_for_special_event(present_priv->xcb_connection,
-            present_priv->special_event)) != NULL)
+    if (present_priv->error_reports_count == PRESENT_MAX_ERROR_REPORTS)
     {
-        PRESENThandle_events(present_priv, (void *) ev);
+        present_priv->error_reports_lost++;
+        return;
     }
+    report = &present_priv->error_reports[present_priv->error_reports_count++];
+    report->serial = present_pixmap_priv->serial;
+    report->window = present_pixmap_priv->present_window;
+    report->width = present_pixmap_priv->width;
+    report->height = present_pixmap_priv->height;
+    report->depth = present_pixmap_priv->depth;
+    report->interval = present_pixmap_priv->present_interval;
+    report->pending = present_pixmap_priv->present_pending;
+    report->error_code = error->error_code;
+    report->major_code = error->major_code;
+    report->minor_code = error->minor_code;
 }
 
-static BOOL PRESENTwait_events(PRESENTpriv *present_priv, BOOL allow_other_threads)
+/* Must be called without any lock held, queries the windows of the failed presents */
+static void PRESENTreport_errors(PRESENTpriv *present_priv)
 {
-    xcb_generic_event_t *ev;
+    struct PRESENTErrorReport reports[PRESENT_MAX_ERROR_REPORTS], *report;
+    xcb_get_geometry_cookie_t cookies[PRESENT_MAX_ERROR_REPORTS];
+    xcb_get_geometry_reply_t *reply;
+    unsigned i, count;
+    UINT lost;
 
-    if (allow_other_threads)
-    {
-        present_priv->xcb_wait = TRUE;
-        EnterCriticalSection(&present_priv->mutex_xcb_wait);
-        LeaveCriticalSection(&present_priv->mutex_present);
-    }
-    ev = xcb_wait_for_special_event(present_priv->xcb_connection, present_priv->special_event);
-    if (allow_other_threads)
-    {
-        LeaveCriticalSection(&present_priv->mutex_xcb_wait);
-        EnterCriticalSection(&present_priv->mutex_present);
-        present_priv->xcb_wait = FALSE;
-    }
-    if (!ev)
+    EnterCriticalSection(&present_priv->mutex_present);
+    count = present_priv->error_reports_count;
+    memcpy(reports, present_priv->error_reports, count * sizeof(*reports));
+    lost = present_priv->error_reports_lost;
+    present_priv->error_reports_count = 0;
+    present_priv->error_reports_lost = 0;
+    LeaveCriticalSection(&present_priv->mutex_present);
+
+    /* All the replies in a single round trip */
+    for (i = 0; i < count; i++)
+        cookies[i] = xcb_get_geometry(present_priv->xcb_connection_bis, reports[i].window);
+
+    for (i = 0; i < count; i++)
     {
-        ERR("FATAL error: xcb had an error\n");
-        return FALSE;
-    }
+        report = &reports[i];
+        reply = xcb_get_geometry_reply(present_priv->xcb_connection_bis, cookies[i], NULL);
 
-    PRESENThandle_events(present_priv, (void *) ev);
-    return TRUE;
-}
+        ERR("Error using PRESENT. Here some debug info\n");
+        ERR("X error %d (major %d, minor %d) on the present of serial %u\n",
+            report->error_code, report->major_code, report->minor_code, report->serial);
+        if (!reply)
+        {
+            ERR("Error querying window info. Perhaps it doesn't exist anymore\n");
+            continue;
+        }
+        ERR("Pixmap: width=%d, height=%d, depth=%d\n",
+            report->width, report->height, report->depth);
 
-static struct xcb_connection_t *create_xcb_connection(Display *dpy)
-{
-    int screen_num = DefaultScreen(dpy);
-    xcb_connection_t *ret;
-    xcb_xfixes_query_version_cookie_t cookie;
-    xcb_xfixes_query_version_reply_t *rep;
+        ERR("Window: width=%d, height=%d, depth=%d, x=%d, y=%d\n",
+            (int) reply->width, (int) reply->height,
+            (int) reply->depth, (int) reply->x, (int) reply->y);
 
-    ret = xcb_connect(DisplayString(dpy), &screen_num);
-    cookie = xcb_xfixes_query_version_unchecked(ret, XCB_XFIXES_MAJOR_VERSION, XCB_XFIXES_MINOR_VERSION);
-    rep = xcb_xfixes_query_version_reply(ret, cookie, NULL);
-    if (rep)
-        free(rep);
-    return ret;
+        ERR("Present parameter: PresentationInterval=%d, Pending presentations=%d\n",
+            report->interval, report->pending);
+
+        if (report->depth != reply->depth)
+            ERR("Depths are different. PRESENT needs the pixmap and the window have same depth\n");
+        free(reply);
+    }
+    if (lost)
+        ERR("%u more presents failed\n", lost);
 }
 
-BOOL PRESENTInit(Display *dpy, PRESENTpriv **present_priv)
+static void PRESENTlog_error(xcb_generic_error_t *error)
 {
-    *present_priv = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(PRESENTpriv));
-
-    if (!*present_priv)
-        return FALSE;
+    ERR("X error %d (major %d, minor %d) on request %u\n", error->error_code,
+        error->major_code, error->minor_code, error->full_sequence);
+}
 
-    (*present_priv)->xcb_connection = create_xcb_connection(dpy);
-    (*present_priv)->xcb_connection_bis = create_xcb_connection(dpy);
+/* Must be called with errors_lock held */
+static void PRESENTconnection_read_errors(struct PRESENTConnection *connection)
+{
+    xcb_generic_event_t *ev;
 
-    InitializeCriticalSection(&(*present_priv)->mutex_present);
-    InitializeCriticalSection(&(*present_priv)->mutex_xcb_wait);
-    return TRUE;
+    while ((ev = xcb_poll_for_event(connection->xcb_connection_bis)) != NULL)
+    {
+        if (ev->response_type != 0)
+        {
+            free(ev);
+            continue;
+        }
+        if (connection->errors_count == PRESENT_MAX_PENDING_ERRORS)
+        {
+            PRESENTlog_error(connection->errors[0]);
+            free(connection->errors[0]);
+            memmove(&connection->errors[0], &connection->errors[1],
+                    --connection->errors_count * sizeof(connection->errors[0]));
+        }
+        connection->errors[connection->errors_count++] = (void *) ev;
+    }
 }
 
-static void PRESENTForceReleases(PRESENTpriv *present_priv)
+/* Must be called with mutex_present held.
+ * No event will come for the presents of the pixmap, release it. */
+static void PRESENTdrop_present(PRESENTpriv *present_priv, PRESENTPixmapPriv *present_pixmap_priv)
 {
-    PRESENTPixmapPriv *current = NULL;
-
-    if (!present_priv->window)
-        return;
+    struct PRESENTWindow *win = PRESENTfind_window(present_priv, present_pixmap_priv->present_window);
 
-    /* There should be no other thread listening for events here.
-     * This can happen when hDestWindowOverride changes without reset.
-     * This case should never happen, but can happen in theory.*/
-    if (present_priv->xcb_wait)
-    {
-        xcb_present_notify_msc(present_priv->xcb_connection, present_priv->window, 0, 0, 0, 0);
-        xcb_flush(present_priv->xcb_connection);
-        EnterCriticalSection(&present_priv->mutex_xcb_wait);
-        LeaveCriticalSection(&present_priv->mutex_xcb_wait);
-        /* the problem here is that we don't have access to the event the other thread got.
-         * It is either presented event, idle event or notify event.
-         */
-        while (present_priv->pixmap_present_pending >= 2)
-            PRESENTwait_events(present_priv, FALSE);
-        PRESENTflush_events(present_priv, TRUE);
-        /* Remaining events to come can be a pair of present/idle,
-         * or an idle, or nothing. To be sure we are after all pixmaps
-         * have been presented, add an event to the queue that can only
-         * be after the present event, then if we receive an event more,
-         * we are sure all pixmaps were presented */
-        present_priv->notify_with_serial_pending = TRUE;
-        xcb_present_notify_msc(present_priv->xcb_connection, present_priv->window,
-                1, present_priv->last_target + 5, 0, 0);
-
-        xcb_flush(present_priv->xcb_connection);
-        while (present_priv->notify_with_serial_pending)
-            PRESENTwait_events(present_priv, FALSE);
-        /* Now we are sure we are not expecting any new event */
-    }
-    else
+    /* The events of earlier presents of the pixmap can't be told apart anymore */
+    while (present_pixmap_priv->present_complete_pending)
     {
-        while (present_priv->pixmap_present_pending) /* wait all sent pixmaps are presented */
-            PRESENTwait_events(present_priv, FALSE);
-        PRESENTflush_events(present_priv, TRUE); /* may be remaining idle event */
-        /* Since idle events are send with the complete events when it is not flips,
-         * we are not expecting any new event here */
+        present_pixmap_priv->present_complete_pending--;
+        present_priv->pixmap_present_pending--;
+        if (win && win->present_pending)
+            win->present_pending--;
     }
+    /* A new serial, so that events coming late anyway aren't taken for the
+     * ones of its next present. Reinserting can't fail, the table doesn't grow. */
+    PRESENTPixmapTableRemove(present_priv, present_pixmap_priv);
+    present_pixmap_priv->serial = PRESENTGetNewSerial();
+    PRESENTPixmapTableInsert(present_priv, present_pixmap_priv);
+    present_pixmap_priv->present_sequence = 0;
+    present_pixmap_priv->present_time = 0;
+    InterlockedExchange(&present_pixmap_priv->released, TRUE);
+    PRESENTfence_trigger(present_pixmap_priv);
+    present_priv->idle_notify_since_last_check = TRUE;
+    WakeAllConditionVariable(&present_pixmap_priv->released_cond);
+    WakeAllConditionVariable(&present_priv->event_cond);
+    PRESENTdeferred_free(present_priv, present_pixmap_priv);
+}
 
-    current = present_priv->first_present_priv;
-    while (current)
+/* Must be called with mutex_present held.
+ * PRESENTPixmap doesn't wait for the result of its requests. Errors
+ * are queued on xcb_connection_bis instead and matched here to the
+ * request that caused them, which won't get any Present event. They
+ * are reported by the next PRESENTPixmap, after releasing the locks.
+ * Returns the number of failed presents. */
+static int PRESENTcollect_errors(PRESENTpriv *present_priv)
+{
+    struct PRESENTConnection *connection = present_priv->connection;
+    PRESENTPixmapPriv *failed[PRESENT_MAX_PENDING_ERRORS];
+    PRESENTPixmapPriv *present_pixmap_priv;
+    unsigned i, j, nfailed = 0;
+
+    EnterCriticalSection(&connection->errors_lock);
+    PRESENTconnection_read_errors(connection);
+    for (i = 0; i < connection->errors_count;)
     {
-        if (!current->released)
+        present_pixmap_priv = NULL;
+        for (j = 0; j < present_priv->pixmap_table_size; j++)
         {
-            if (!current->last_present_was_flip && !present_priv->xcb_wait)
-            {
-                ERR("ERROR: a pixmap seems not released by PRESENT for no reason. Code bug.\n");
-            }
-            else
+            if (present_priv->pixmap_table[j] &&
+                present_priv->pixmap_table[j]->present_sequence &&
+                present_priv->pixmap_table[j]->present_sequence == connection->errors[i]->full_sequence)
             {
-                /* Present the same pixmap with a non-valid part to force the copy mode and the releases */
-                xcb_xfixes_region_t valid, update;
-                xcb_rectangle_t rect_update;
-                rect_update.x = 0;
-                rect_update.y = 0;
-                rect_update.width = 8;
-                rect_update.height = 1;
-                valid = xcb_generate_id(present_priv->xcb_connection);
-                update = xcb_generate_id(present_priv->xcb_connection);
-                xcb_xfixes_create_region(present_priv->xcb_connection, valid, 1, &rect_update);
-                xcb_xfixes_create_region(present_priv->xcb_connection, update, 1, &rect_update);
-                /* here we know the pixmap has been presented. Thus if it is on screen,
-                 * the following request can only make it released by the server if it is not */
-                xcb_present_pixmap(present_priv->xcb_connection, present_priv->window,
-                        current->pixmap, 0, valid, update, 0, 0, None, None,
-                        None, XCB_PRESENT_OPTION_COPY | XCB_PRESENT_OPTION_ASYNC, 0, 0, 0, 0, NULL);
-                xcb_flush(present_priv->xcb_connection);
-                PRESENTwait_events(present_priv, FALSE); /* by assumption this can only be idle event */
-                PRESENTflush_events(present_priv, TRUE); /* Shoudln't be needed */
+                present_pixmap_priv = present_priv->pixmap_table[j];
+                break;
             }
         }
-        current = current->next;
+        if (!present_pixmap_priv)
+        {
+            /* error of another PRESENTpriv */
+            i++;
+            continue;
+        }
+        PRESENTadd_error_report(present_priv, present_pixmap_priv, connection->errors[i]);
+        free(connection->errors[i]);
+        memmove(&connection->errors[i], &connection->errors[i + 1],
+                (--connection->errors_count - i) * sizeof(connection->errors[0]));
+        failed[nfailed++] = present_pixmap_priv;
     }
-    /* Now all pixmaps are released (possibility if xcb_wait is true that one is not aware yet),
-     * and we don't expect any new Present event to come from Xserver */
-}
+    LeaveCriticalSection(&connection->errors_lock);
 
-static void PRESENTFreeXcbQueue(PRESENTpriv *present_priv)
-{
-    if (present_priv->window)
+    for (i = 0; i < nfailed; i++)
     {
-        xcb_unregister_for_special_event(present_priv->xcb_connection, present_priv->special_event);
-        present_priv->last_msc = 0;
-        present_priv->last_target = 0;
-        present_priv->special_event = NULL;
+        present_pixmap_priv = failed[i];
+        if (present_record_log)
+            PRESENTrecord_event(PRESENT_RECORD_ERROR, present_pixmap_priv->present_window,
+                    present_pixmap_priv->serial, 0, 0, present_pixmap_priv->present_target_msc, 0);
+
+        PRESENTdrop_present(present_priv, present_pixmap_priv);
     }
+    return nfailed;
 }
 
-static BOOL PRESENTPrivChangeWindow(PRESENTpriv *present_priv, XID window)
+/* Must be called with mutex_present held, frees ge */
+static void PRESENTdispatch_event(PRESENTpriv *present_priv, xcb_present_generic_event_t *ge)
 {
-    xcb_void_cookie_t cookie;
-    xcb_generic_error_t *error;
-    xcb_present_event_t eid;
-    xcb_get_geometry_cookie_t cookie_geom;
-    xcb_get_geometry_reply_t *reply_geom;
-
-    PRESENTForceReleases(present_priv);
-    PRESENTFreeXcbQueue(present_priv);
-    present_priv->window = window;
+    uint64_t start = PRESENTnow_ns();
 
-    if (window)
-    {
-        /* We track geometry changes. Initialize the values */
-        cookie_geom = xcb_get_geometry(present_priv->xcb_connection, window);
-        reply_geom = xcb_get_geometry_reply(present_priv->xcb_connection, cookie_geom, NULL);
-        if (!reply_geom)
-        {
-            ERR("FAILED to get window size. Was the destination a window ?\n");
-            present_priv->window = 0;
-            return FALSE;
-        }
-        present_priv->last_x = reply_geom->x;
-        present_priv->last_y = reply_geom->y;
-        present_priv->last_width = reply_geom->width;
-        present_priv->last_height = reply_geom->height;
-        present_priv->last_depth = reply_geom->depth;
-        present_priv->win_updated = TRUE;
-        free(reply_geom);
+    PRESENThandle_events(present_priv, ge);
+    present_priv->timings.events++;
+    present_priv->timings.event_time += PRESENTnow_ns() - start;
+}
 
-        cookie = xcb_present_select_input_checked(present_priv->xcb_connection,
-                (eid = xcb_generate_id(present_priv->xcb_connection)), window,
-                XCB_PRESENT_EVENT_MASK_CONFIGURE_NOTIFY |
-                XCB_PRESENT_EVENT_MASK_COMPLETE_NOTIFY | XCB_PRESENT_EVENT_MASK_IDLE_NOTIFY);
+/* Must be called with mutex_present held. Only the event thread calls this,
+ * as it must be the only one to read events of xcb_connection. */
+static void PRESENTflush_events(PRESENTpriv *present_priv)
+{
+    xcb_generic_event_t *ev;
+    unsigned i;
 
-        present_priv->special_event = xcb_register_for_special_xge(present_priv->xcb_connection,
-                &xcb_present_id, eid, NULL);
+    for (i = 0; i < PRESENT_WINDOW_CACHE_SIZE; i++)
+    {
+        if (!present_priv->windows[i].special_event)
+            continue;
 
-        error = xcb_request_check(present_priv->xcb_connection, cookie); /* performs a flush */
-        if (error || !present_priv->special_event)
-        {
-            ERR("FAILED to use the X PRESENT extension. Was the destination a window ?\n");
-            if (present_priv->special_event)
-                xcb_unregister_for_special_event(present_priv->xcb_connection, present_priv->special_event);
-            present_priv->special_event = NULL;
-            present_priv->window = 0;
-        }
+        while ((ev = xcb_poll_for_special_event(present_priv->xcb_connection,
+                present_priv->windows[i].special_event)) != NULL)
+            PRESENTdispatch_event(present_priv, (void *) ev);
     }
-    return (present_priv->window != 0);
 }
 
-/* Destroy the content, except the link and the struct mem */
-static void PRESENTDestroyPixmapContent(PRESENTPixmapPriv *present_pixmap)
+static void PRESENTwake_event_thread(struct PRESENTConnection *connection);
+static void PRESENTrequest_vblank(PRESENTpriv *present_priv);
+
+/* Must be called with mutex_present held.
+ * Returns the PRESENTnow() after which the missing Present events are overdue. */
+static uint64_t PRESENTevents_deadline(PRESENTpriv *present_priv)
+{
+    uint64_t last = max(present_priv->last_event_time, present_priv->last_resync_time);
+
+    return max(last, present_priv->events_expected) + PRESENT_WAIT_TIMEOUT * 1000;
+}
+
+/* Must be called with mutex_present held.
+ * Called when the Present events are overdue by PRESENT_WAIT_TIMEOUT, for example
+ * because the compositor restarted or the window got destroyed behind our back. */
+static void PRESENTresync(PRESENTpriv *present_priv)
+{
+    PRESENTPixmapPriv *present_pixmap_priv, **lost;
+    struct PRESENTWindow *win;
+    uint64_t now = PRESENTnow();
+    unsigned i, nlost = 0;
+
+    present_priv->timings.wait_timeouts++;
+    WARN("No Present event for %llu ms, resynchronizing\n",
+         (unsigned long long)(now - present_priv->last_event_time) / 1000);
+    present_priv->last_resync_time = now;
+
+    /* Events may be stuck in the xcb queues */
+    PRESENTwake_event_thread(present_priv->connection);
+
+    /* The msc the presents target may be stale, get the current one */
+    if (present_priv->current)
+        PRESENTrequest_vblank(present_priv);
+
+    /* PRESENTdrop_present may free pixmaps and reorder the table */
+    lost = HeapAlloc(GetProcessHeap(), 0, present_priv->pixmap_table_count * sizeof(*lost));
+
+    /* The idle fence may have released a pixmap whose complete event is missing */
+    for (i = 0; i < present_priv->pixmap_table_size; i++)
+    {
+        present_pixmap_priv = present_priv->pixmap_table[i];
+        if (!present_pixmap_priv ||
+            (present_pixmap_priv->released && !present_pixmap_priv->present_complete_pending) ||
+            now < present_pixmap_priv->present_expected + PRESENT_WAIT_TIMEOUT * 1000)
+            continue;
+
+        win = PRESENTfind_window(present_priv, present_pixmap_priv->present_window);
+        /* Give up once the crtc is well past the target msc, or doesn't count anymore */
+        if (lost && now >= present_pixmap_priv->present_expected + PRESENT_LOST_TIMEOUT * 1000 &&
+            (!win || win->last_msc >= present_pixmap_priv->present_target_msc + PRESENT_LOST_REFRESHES ||
+             now >= present_priv->last_event_time + PRESENT_LOST_TIMEOUT * 1000))
+        {
+            lost[nlost++] = present_pixmap_priv;
+        }
+        /* A flip nothing replaces holds its pixmap */
+        else if (!present_pixmap_priv->present_complete_pending && !present_pixmap_priv->released &&
+                 present_pixmap_priv->last_present_was_flip &&
+                 !present_pixmap_priv->resync_copy_sent && win)
+        {
+            present_pixmap_priv->resync_copy_sent = TRUE;
+            PRESENTforce_copy(present_priv, present_pixmap_priv->present_window, present_pixmap_priv);
+        }
+    }
+
+    for (i = 0; i < nlost; i++)
+    {
+        WARN("Giving up the present of serial %u\n", lost[i]->serial);
+        present_priv->timings.lost_presents++;
+        PRESENTdrop_present(present_priv, lost[i]);
+    }
+    HeapFree(GetProcessHeap(), 0, lost);
+}
+
+/* Must be called with mutex_present held. Sleeps until the event thread
+ * signals cond or for max_wait ms, or resynchronizes when the events are
+ * overdue. The caller has to recheck its condition afterwards. */
+static BOOL PRESENTwait_events_for(PRESENTpriv *present_priv, CONDITION_VARIABLE *cond, DWORD max_wait)
+{
+    uint64_t now, deadline;
+    unsigned i;
+
+    for (i = 0; i < PRESENT_WINDOW_CACHE_SIZE; i++)
+    {
+        if (present_priv->windows[i].special_event)
+            break;
+    }
+    if (present_priv->event_thread_error || i == PRESENT_WINDOW_CACHE_SIZE)
+    {
+        ERR("FATAL error: no Present events to wait for\n");
+        return FALSE;
+    }
+
+    /* A failed present may be what we are waiting for */
+    if (PRESENTcollect_errors(present_priv))
+        return TRUE;
+
+    now = PRESENTnow();
+    deadline = PRESENTevents_deadline(present_priv);
+    if (now < deadline &&
+        (SleepConditionVariableCS(cond, &present_priv->mutex_present,
+                min(max_wait, (deadline - now + 999) / 1000)) ||
+         GetLastError() != ERROR_TIMEOUT))
+        return TRUE;
+
+    /* Events of other conditions may have moved the deadline */
+    if (PRESENTnow() >= PRESENTevents_deadline(present_priv))
+        PRESENTresync(present_priv);
+    return TRUE;
+}
+
+static BOOL PRESENTwait_events(PRESENTpriv *present_priv, CONDITION_VARIABLE *cond)
+{
+    return PRESENTwait_events_for(present_priv, cond, INFINITE);
+}
+
+/* Interrupts the epoll_wait() of the event thread to dispatch all
+ * connections, for example because special_event changed. */
+static void PRESENTwake_event_thread(struct PRESENTConnection *connection)
+{
+    static const char c = 0;
+
+    if (write(connection->reactor->wakeup[1], &c, 1) < 0 && errno != EAGAIN)
+        ERR("Failed to wake up the Present event thread\n");
+}
+
+/* Must be called with mutex_present held */
+static void PRESENTevents_lost(PRESENTpriv *present_priv)
+{
+    unsigned i;
+
+    /* don't let anybody wait for events that will never be handled */
+    present_priv->event_thread_error = TRUE;
+    WakeAllConditionVariable(&present_priv->event_cond);
+    for (i = 0; i < present_priv->pixmap_table_size; i++)
+    {
+        if (!present_priv->pixmap_table[i])
+            continue;
+        /* unblock threads sleeping on the idle fence */
+        if (!present_priv->pixmap_table[i]->released)
+            PRESENTfence_trigger(present_priv->pixmap_table[i]);
+        WakeAllConditionVariable(&present_priv->pixmap_table[i]->released_cond);
+    }
+}
+
+/* Must be called with dispatch_lock held */
+static void PRESENTconnection_dispatch(struct PRESENTConnection *connection)
+{
+    xcb_generic_event_t *ev;
+    uint32_t last_sequence = 0;
+    BOOL have_errors;
+    unsigned i;
+
+    EnterCriticalSection(&connection->errors_lock);
+    PRESENTconnection_read_errors(connection);
+    have_errors = connection->errors_count != 0;
+    if (have_errors)
+        last_sequence = connection->errors[connection->errors_count - 1]->full_sequence;
+    LeaveCriticalSection(&connection->errors_lock);
+
+    for (i = 0; i < connection->privs_count; i++)
+    {
+        PRESENTpriv *present_priv = connection->privs[i];
+
+        EnterCriticalSection(&present_priv->mutex_present);
+        PRESENTflush_events(present_priv);
+        PRESENTcollect_errors(present_priv);
+        LeaveCriticalSection(&present_priv->mutex_present);
+    }
+
+    /* Every PRESENTpriv had the chance to claim these errors */
+    if (have_errors)
+    {
+        EnterCriticalSection(&connection->errors_lock);
+        while (connection->errors_count &&
+               (int32_t)(connection->errors[0]->full_sequence - last_sequence) <= 0)
+        {
+            PRESENTlog_error(connection->errors[0]);
+            free(connection->errors[0]);
+            memmove(&connection->errors[0], &connection->errors[1],
+                    --connection->errors_count * sizeof(connection->errors[0]));
+        }
+        LeaveCriticalSection(&connection->errors_lock);
+    }
+
+    /* Events of unregistered special events, and errors of requests
+     * nobody checks, end up in the regular queue */
+    while ((ev = xcb_poll_for_event(connection->xcb_connection)) != NULL)
+    {
+        if (ev->response_type == 0)
+            TRACE("Ignoring X error %d on request %u\n",
+                  ((xcb_generic_error_t *) ev)->error_code, ev->full_sequence);
+        free(ev);
+    }
+}
+
+/* Must be called with dispatch_lock held */
+static void PRESENTconnection_lost(struct PRESENTConnection *connection)
+{
+    unsigned i;
+
+    connection->event_thread_error = TRUE;
+    epoll_ctl(connection->reactor->epoll_fd, EPOLL_CTL_DEL,
+              xcb_get_file_descriptor(connection->xcb_connection), NULL);
+    epoll_ctl(connection->reactor->epoll_fd, EPOLL_CTL_DEL,
+              xcb_get_file_descriptor(connection->xcb_connection_bis), NULL);
+    for (i = 0; i < connection->privs_count; i++)
+    {
+        EnterCriticalSection(&connection->privs[i]->mutex_present);
+        PRESENTevents_lost(connection->privs[i]);
+        LeaveCriticalSection(&connection->privs[i]->mutex_present);
+    }
+}
+
+/* Must be called with reactor_section held */
+static void PRESENTconnection_poll(struct PRESENTConnection *connection)
+{
+    EnterCriticalSection(&connection->dispatch_lock);
+    if (!connection->event_thread_error)
+    {
+        PRESENTconnection_dispatch(connection);
+
+        if (xcb_connection_has_error(connection->xcb_connection) ||
+            xcb_connection_has_error(connection->xcb_connection_bis))
+        {
+            ERR("FATAL error: xcb had an error on display %s\n", connection->display_name);
+            PRESENTconnection_lost(connection);
+        }
+    }
+    LeaveCriticalSection(&connection->dispatch_lock);
+}
+
+static DWORD WINAPI PRESENTevent_thread(void *arg)
+{
+    struct PRESENTReactor *r = arg;
+    struct epoll_event events[PRESENT_MAX_EPOLL_EVENTS];
+    BOOL dispatch_all = TRUE;
+    char buf[16];
+    unsigned i;
+    int j, n = 0;
+
+    EnterCriticalSection(&reactor_section);
+    while (!r->quit)
+    {
+        /* The ready connections may have been unregistered in the meantime,
+         * only the registered ones are looked at. */
+        for (i = 0; i < r->connections_count; i++)
+        {
+            for (j = 0; !dispatch_all && j < n; j++)
+            {
+                if (events[j].data.ptr == r->connections[i])
+                    break;
+            }
+            if (dispatch_all || j < n)
+                PRESENTconnection_poll(r->connections[i]);
+        }
+
+        LeaveCriticalSection(&reactor_section);
+        n = epoll_wait(r->epoll_fd, events, PRESENT_MAX_EPOLL_EVENTS, -1);
+        if (n < 0 && errno != EINTR)
+        {
+            ERR("FATAL error: epoll_wait failed (errno=%d)\n", errno);
+            EnterCriticalSection(&reactor_section);
+            break;
+        }
+        dispatch_all = FALSE;
+        for (j = 0; j < n; j++)
+        {
+            if (!events[j].data.ptr)
+            {
+                while (read(r->wakeup[0], buf, sizeof(buf)) > 0);
+                dispatch_all = TRUE;
+            }
+        }
+        EnterCriticalSection(&reactor_section);
+    }
+
+    if (!r->quit)
+    {
+        for (i = 0; i < r->connections_count; i++)
+        {
+            EnterCriticalSection(&r->connections[i]->dispatch_lock);
+            if (!r->connections[i]->event_thread_error)
+                PRESENTconnection_lost(r->connections[i]);
+            LeaveCriticalSection(&r->connections[i]->dispatch_lock);
+        }
+    }
+    LeaveCriticalSection(&reactor_section);
+    return 0;
+}
+
+static void PRESENTreactor_free(struct PRESENTReactor *r)
+{
+    if (r->epoll_fd >= 0)
+        close(r->epoll_fd);
+    if (r->wakeup[0] >= 0)
+    {
+        close(r->wakeup[0]);
+        close(r->wakeup[1]);
+    }
+    HeapFree(GetProcessHeap(), 0, r->connections);
+    HeapFree(GetProcessHeap(), 0, r);
+}
+
+/* Must be called with reactor_section held */
+static struct PRESENTReactor *PRESENTreactor_create(void)
+{
+    struct PRESENTReactor *r;
+    struct epoll_event ev;
+
+    r = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*r));
+    if (!r)
+        return NULL;
+    r->wakeup[0] = r->wakeup[1] = -1;
+
+    r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epoll_fd < 0 || pipe2(r->wakeup, O_CLOEXEC | O_NONBLOCK) < 0)
+    {
+        ERR("Failed to create the event thread's epoll (errno=%d)\n", errno);
+        PRESENTreactor_free(r);
+        return NULL;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->wakeup[0], &ev) < 0)
+    {
+        ERR("Failed to add the wakeup pipe to epoll (errno=%d)\n", errno);
+        PRESENTreactor_free(r);
+        return NULL;
+    }
+
+    r->thread = CreateThread(NULL, 0, PRESENTevent_thread, r, 0, NULL);
+    if (!r->thread)
+    {
+        ERR("Failed to create Present event thread\n");
+        PRESENTreactor_free(r);
+        return NULL;
+    }
+    return r;
+}
+
+/* Starts the event thread with the first connection */
+static BOOL PRESENTreactor_register(struct PRESENTConnection *connection)
+{
+    struct PRESENTConnection **connections;
+    struct epoll_event ev;
+    unsigned size;
+
+    EnterCriticalSection(&reactor_section);
+    if (!reactor && !(reactor = PRESENTreactor_create()))
+    {
+        LeaveCriticalSection(&reactor_section);
+        return FALSE;
+    }
+
+    if (reactor->connections_count == reactor->connections_size)
+    {
+        size = reactor->connections_size ? reactor->connections_size * 2 : 4;
+        connections = HeapAlloc(GetProcessHeap(), 0, size * sizeof(*connections));
+        if (!connections)
+            goto fail;
+        if (reactor->connections_count)
+            memcpy(connections, reactor->connections,
+                   reactor->connections_count * sizeof(*connections));
+        HeapFree(GetProcessHeap(), 0, reactor->connections);
+        reactor->connections = connections;
+        reactor->connections_size = size;
+    }
+
+    /* errors of presents arrive on xcb_connection_bis */
+    ev.events = EPOLLIN;
+    ev.data.ptr = connection;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD,
+                  xcb_get_file_descriptor(connection->xcb_connection), &ev) < 0)
+        goto fail;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD,
+                  xcb_get_file_descriptor(connection->xcb_connection_bis), &ev) < 0)
+    {
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL,
+                  xcb_get_file_descriptor(connection->xcb_connection), NULL);
+        goto fail;
+    }
+
+    reactor->connections[reactor->connections_count++] = connection;
+    connection->reactor = reactor;
+    LeaveCriticalSection(&reactor_section);
+    return TRUE;
+
+fail:
+    ERR("Failed to add display %s to the event thread\n", connection->display_name);
+    LeaveCriticalSection(&reactor_section);
+    return FALSE;
+}
+
+/* Stops the event thread with the last connection */
+static void PRESENTreactor_unregister(struct PRESENTConnection *connection)
+{
+    struct PRESENTReactor *r = connection->reactor;
+    unsigned i;
+
+    EnterCriticalSection(&reactor_section);
+    for (i = 0; i < r->connections_count; i++)
+    {
+        if (r->connections[i] == connection)
+        {
+            r->connections[i] = r->connections[--r->connections_count];
+            break;
+        }
+    }
+    epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, xcb_get_file_descriptor(connection->xcb_connection), NULL);
+    epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, xcb_get_file_descriptor(connection->xcb_connection_bis), NULL);
+    connection->reactor = NULL;
+
+    if (r->connections_count)
+    {
+        LeaveCriticalSection(&reactor_section);
+        return;
+    }
+
+    /* A new connection gets a new event thread */
+    if (reactor == r)
+        reactor = NULL;
+    r->quit = TRUE;
+    if (write(r->wakeup[1], "", 1) < 0 && errno != EAGAIN)
+        ERR("Failed to wake up the Present event thread\n");
+    LeaveCriticalSection(&reactor_section);
+
+    WaitForSingleObject(r->thread, INFINITE);
+    CloseHandle(r->thread);
+    PRESENTreactor_free(r);
+}
+
+static struct xcb_connection_t *create_xcb_connection(Display *dpy)
+{
+    int screen_num = DefaultScreen(dpy);
+    xcb_connection_t *ret;
+    xcb_xfixes_query_version_cookie_t cookie;
+    xcb_xfixes_query_version_reply_t *rep;
+
+    ret = xcb_connect(DisplayString(dpy), &screen_num);
+    cookie = xcb_xfixes_query_version_unchecked(ret, XCB_XFIXES_MAJOR_VERSION, XCB_XFIXES_MINOR_VERSION);
+    rep = xcb_xfixes_query_version_reply(ret, cookie, NULL);
+    if (rep)
+        free(rep);
+    return ret;
+}
+
+static void PRESENTconnection_free(struct PRESENTConnection *connection)
+{
+    unsigned i;
+
+    for (i = 0; i < connection->errors_count; i++)
+    {
+        PRESENTlog_error(connection->errors[i]);
+        free(connection->errors[i]);
+    }
+    if (connection->xcb_connection)
+        xcb_disconnect(connection->xcb_connection);
+    if (connection->xcb_connection_bis)
+        xcb_disconnect(connection->xcb_connection_bis);
+    DeleteCriticalSection(&connection->dispatch_lock);
+    DeleteCriticalSection(&connection->errors_lock);
+    HeapFree(GetProcessHeap(), 0, connection->privs);
+    HeapFree(GetProcessHeap(), 0, connection->display_name);
+    HeapFree(GetProcessHeap(), 0, connection);
+}
+
+static struct PRESENTConnection *PRESENTconnection_create(Display *dpy)
+{
+    struct PRESENTConnection *connection;
+    const char *name = DisplayString(dpy);
+
+    connection = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*connection));
+    if (!connection)
+        return NULL;
+
+    connection->display_name = HeapAlloc(GetProcessHeap(), 0, strlen(name) + 1);
+    if (!connection->display_name)
+    {
+        HeapFree(GetProcessHeap(), 0, connection);
+        return NULL;
+    }
+    strcpy(connection->display_name, name);
+
+    InitializeCriticalSection(&connection->dispatch_lock);
+    InitializeCriticalSection(&connection->errors_lock);
+    connection->refs = 1;
+
+    connection->xcb_connection = create_xcb_connection(dpy);
+    connection->xcb_connection_bis = create_xcb_connection(dpy);
+    if (xcb_connection_has_error(connection->xcb_connection) ||
+        xcb_connection_has_error(connection->xcb_connection_bis))
+    {
+        ERR("Failed to connect to display %s\n", name);
+        PRESENTconnection_free(connection);
+        return NULL;
+    }
+
+    if (!PRESENTreactor_register(connection))
+    {
+        PRESENTconnection_free(connection);
+        return NULL;
+    }
+    return connection;
+}
+
+static struct PRESENTConnection *PRESENTconnection_acquire(Display *dpy)
+{
+    struct PRESENTConnection *connection;
+    const char *name = DisplayString(dpy);
+
+    EnterCriticalSection(&connection_pool_section);
+    for (connection = connection_pool; connection; connection = connection->next)
+    {
+        if (!strcmp(connection->display_name, name) &&
+            !connection->event_thread_error &&
+            !xcb_connection_has_error(connection->xcb_connection_bis))
+        {
+            connection->refs++;
+            LeaveCriticalSection(&connection_pool_section);
+            return connection;
+        }
+    }
+
+    connection = PRESENTconnection_create(dpy);
+    if (connection)
+    {
+        connection->next = connection_pool;
+        connection_pool = connection;
+        connection_pool_count += 2;
+        TRACE("Opened X connections to %s, %u connections open\n", name, connection_pool_count);
+    }
+    LeaveCriticalSection(&connection_pool_section);
+    return connection;
+}
+
+static void PRESENTconnection_release(struct PRESENTConnection *connection)
+{
+    struct PRESENTConnection **prev;
+
+    EnterCriticalSection(&connection_pool_section);
+    if (--connection->refs)
+    {
+        LeaveCriticalSection(&connection_pool_section);
+        return;
+    }
+    for (prev = &connection_pool; *prev != connection; prev = &(*prev)->next);
+    *prev = connection->next;
+    connection_pool_count -= 2;
+    TRACE("Closing X connections to %s, %u connections open\n",
+          connection->display_name, connection_pool_count);
+    LeaveCriticalSection(&connection_pool_section);
+
+    /* Once unregistered, the event thread doesn't touch connection anymore */
+    PRESENTreactor_unregister(connection);
+    PRESENTconnection_free(connection);
+}
+
+BOOL PRESENTInit(Display *dpy, PRESENTpriv **present_priv)
+{
+    struct PRESENTConnection *connection;
+
+    present_record_init();
+
+    *present_priv = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(PRESENTpriv));
+
+    if (!*present_priv)
+        return FALSE;
+
+    connection = PRESENTconnection_acquire(dpy);
+    if (!connection)
+    {
+        HeapFree(GetProcessHeap(), 0, *present_priv);
+        return FALSE;
+    }
+    (*present_priv)->connection = connection;
+    (*present_priv)->xcb_connection = connection->xcb_connection;
+    (*present_priv)->xcb_connection_bis = connection->xcb_connection_bis;
+
+    InitializeCriticalSection(&(*present_priv)->mutex_present);
+    InitializeConditionVariable(&(*present_priv)->event_cond);
+
+    EnterCriticalSection(&connection->dispatch_lock);
+    if (connection->privs_count == connection->privs_size)
+    {
+        unsigned size = connection->privs_size ? connection->privs_size * 2 : 4;
+        PRESENTpriv **privs;
+
+        privs = HeapAlloc(GetProcessHeap(), 0, size * sizeof(*privs));
+        if (!privs)
+        {
+            LeaveCriticalSection(&connection->dispatch_lock);
+            PRESENTconnection_release(connection);
+            DeleteCriticalSection(&(*present_priv)->mutex_present);
+            HeapFree(GetProcessHeap(), 0, *present_priv);
+            return FALSE;
+        }
+        if (connection->privs_count)
+            memcpy(privs, connection->privs, connection->privs_count * sizeof(*privs));
+        HeapFree(GetProcessHeap(), 0, connection->privs);
+        connection->privs = privs;
+        connection->privs_size = size;
+    }
+    connection->privs[connection->privs_count++] = *present_priv;
+    (*present_priv)->event_thread_error = connection->event_thread_error;
+    LeaveCriticalSection(&connection->dispatch_lock);
+    return TRUE;
+}
+
+/* Must be called with mutex_present held.
+ * Waits until the server doesn't hold any pixmap presented to win. */
+static void PRESENTForceReleases(PRESENTpriv *present_priv, struct PRESENTWindow *win)
+{
+    PRESENTPixmapPriv *current = NULL;
+    unsigned i;
+
+    if (!win->window)
+        return;
+
+    /* wait all sent pixmaps are presented. The event thread handles
+     * the idle events of copies before the complete events, so after
+     * that only flipped pixmaps can still be held by the Xserver. */
+    while (win->present_pending)
+    {
+        if (!PRESENTwait_events(present_priv, &present_priv->event_cond))
+            return;
+    }
+
+    for (i = 0; i < present_priv->pixmap_table_size; i++)
+    {
+        current = present_priv->pixmap_table[i];
+        if (current && !current->released && current->present_window == win->window)
+        {
+            if (!current->last_present_was_flip)
+                ERR("ERROR: a pixmap seems not released by PRESENT for no reason. Code bug.\n");
+            else
+                PRESENTforce_copy(present_priv, win->window, current);
+        }
+    }
+
+    /* Don't keep pointers to the pixmaps while waiting: the event
+     * thread frees those with a deferred free once released. */
+    for (;;)
+    {
+        for (i = 0; i < present_priv->pixmap_table_size; i++)
+        {
+            current = present_priv->pixmap_table[i];
+            if (current && !current->released && current->last_present_was_flip &&
+                current->present_window == win->window)
+                break;
+        }
+        if (i == present_priv->pixmap_table_size)
+            break;
+        if (!PRESENTwait_events(present_priv, &present_priv->event_cond))
+            break;
+    }
+    /* Now all pixmaps are released and we don't expect any new Present event to come from Xserver */
+}
+
+static void PRESENTFreeXcbQueue(PRESENTpriv *present_priv, struct PRESENTWindow *win)
+{
+    if (win->window)
+    {
+        /* The connection outlives the window, stop its events */
+        if (win->special_event)
+        {
+            xcb_present_select_input(present_priv->xcb_connection, win->event_id,
+                    win->window, 0);
+            xcb_flush(present_priv->xcb_connection);
+            xcb_unregister_for_special_event(present_priv->xcb_connection, win->special_event);
+        }
+        if (win->capabilities_sequence)
+            xcb_discard_reply(present_priv->xcb_connection_bis, win->capabilities_sequence);
+    }
+    memset(win, 0, sizeof(*win));
+}
+
+/* Must be called with mutex_present held */
+static BOOL PRESENTRegisterWindow(PRESENTpriv *present_priv, struct PRESENTWindow *win, XID window)
 {
-    PRESENTpriv *present_priv = present_pixmap->present_priv;
     xcb_void_cookie_t cookie;
     xcb_generic_error_t *error;
+    xcb_present_event_t eid;
+    xcb_get_geometry_cookie_t cookie_geom;
+    xcb_get_geometry_reply_t *reply_geom;
+    xcb_present_query_capabilities_cookie_t cookie_caps;
+    xcb_present_query_capabilities_reply_t *reply_caps;
+
+    /* Both replies in a single round trip */
+    cookie_caps = xcb_present_query_capabilities(present_priv->xcb_connection_bis, window);
+    /* We track geometry changes. Initialize the values */
+    cookie_geom = xcb_get_geometry(present_priv->xcb_connection_bis, window);
+    reply_geom = xcb_get_geometry_reply(present_priv->xcb_connection_bis, cookie_geom, NULL);
+    reply_caps = xcb_present_query_capabilities_reply(present_priv->xcb_connection_bis, cookie_caps, NULL);
+    if (reply_caps)
+    {
+        win->capabilities = reply_caps->capabilities;
+        TRACE("Window %lx capabilities %#x\n", (unsigned long)window, win->capabilities);
+        free(reply_caps);
+    }
+    if (!reply_geom)
+    {
+        ERR("FAILED to get window size. Was the destination a window ?\n");
+        return FALSE;
+    }
+    win->last_x = reply_geom->x;
+    win->last_y = reply_geom->y;
+    win->last_width = reply_geom->width;
+    win->last_height = reply_geom->height;
+    win->last_depth = reply_geom->depth;
+    free(reply_geom);
+
+    cookie = xcb_present_select_input_checked(present_priv->xcb_connection,
+            (eid = xcb_generate_id(present_priv->xcb_connection)), window,
+            XCB_PRESENT_EVENT_MASK_CONFIGURE_NOTIFY |
+            XCB_PRESENT_EVENT_MASK_COMPLETE_NOTIFY | XCB_PRESENT_EVENT_MASK_IDLE_NOTIFY);
+
+    win->special_event = xcb_register_for_special_xge(present_priv->xcb_connection,
+            &xcb_present_id, eid, NULL);
+    win->event_id = eid;
+
+    error = xcb_request_check(present_priv->xcb_connection, cookie); /* performs a flush */
+    /* xcb_request_check may have queued events the event thread didn't poll for */
+    PRESENTwake_event_thread(present_priv->connection);
+    if (error || !win->special_event)
+    {
+        ERR("FAILED to use the X PRESENT extension. Was the destination a window ?\n");
+        free(error);
+        if (win->special_event)
+            xcb_unregister_for_special_event(present_priv->xcb_connection, win->special_event);
+        memset(win, 0, sizeof(*win));
+        return FALSE;
+    }
+    win->window = window;
+    return TRUE;
+}
 
-    TRACE("Releasing pixmap priv %p\n", present_pixmap);
+/* Returns a free entry of the window cache, or the least recently used */
+static struct PRESENTWindow *PRESENTwindow_slot(PRESENTpriv *present_priv)
+{
+    struct PRESENTWindow *win = &present_priv->windows[0];
+    unsigned i;
 
-    cookie = xcb_free_pixmap(present_priv->xcb_connection,
-                             present_pixmap->pixmap);
+    for (i = 0; i < PRESENT_WINDOW_CACHE_SIZE && win->window; i++)
+    {
+        if (!present_priv->windows[i].window ||
+            present_priv->windows[i].last_use < win->last_use)
+            win = &present_priv->windows[i];
+    }
+    return win;
+}
 
-    error = xcb_request_check(present_priv->xcb_connection, cookie);
-    if (error)
-        ERR("Failed to free pixmap\n");
+/* Switching to a window of the cache neither waits nor does round trips */
+static BOOL PRESENTPrivChangeWindow(PRESENTpriv *present_priv, XID window)
+{
+    struct PRESENTWindow *win = present_priv->current;
+    PRESENTPixmapPriv *current;
+
+    if (win)
+    {
+        /* The last flip of the window we leave holds its pixmap until the
+         * next present to it. The earlier flips were replaced by it, and the
+         * complete events of the pending ones force the copy themselves. */
+        current = win->flip_pixmap;
+        if (current && !current->released && !current->present_complete_pending &&
+            current->last_present_was_flip && current->present_window == win->window)
+            PRESENTforce_copy(present_priv, win->window, current);
+    }
+
+    present_priv->current = NULL;
+    present_priv->window = 0;
+    PRESENTpublish_geometry(present_priv);
+    if (!window)
+        return FALSE;
+
+    win = PRESENTfind_window(present_priv, window);
+    if (!win)
+    {
+        win = PRESENTwindow_slot(present_priv);
+        if (win->window)
+            TRACE("Evicting window %lx from the cache\n", (unsigned long)win->window);
+        PRESENTForceReleases(present_priv, win);
+        PRESENTFreeXcbQueue(present_priv, win);
+
+        present_priv->timings.window_registers++;
+        if (!PRESENTRegisterWindow(present_priv, win, window))
+            return FALSE;
+    }
+
+    win->last_use = ++present_priv->window_use_count;
+    present_priv->current = win;
+    present_priv->window = window;
+    PRESENTpublish_geometry(present_priv);
+    return TRUE;
+}
+
+/* Destroy the content, except the link and the struct mem.
+ * The request isn't flushed, and errors are only logged by the event thread. */
+static void PRESENTDestroyPixmapContent(PRESENTPixmapPriv *present_pixmap)
+{
+    PRESENTpriv *present_priv = present_pixmap->present_priv;
+
+    TRACE("Releasing pixmap priv %p\n", present_pixmap);
+
+    PRESENTfence_destroy(present_priv, present_pixmap);
+    xcb_free_pixmap(present_priv->xcb_connection_bis, present_pixmap->pixmap);
 }
 
 void PRESENTDestroy(PRESENTpriv *present_priv)
 {
-    PRESENTPixmapPriv *current = NULL;
+    struct PRESENTConnection *connection = present_priv->connection;
+    unsigned i;
 
     EnterCriticalSection(&present_priv->mutex_present);
+    for (i = 0; i < PRESENT_WINDOW_CACHE_SIZE; i++)
+        PRESENTForceReleases(present_priv, &present_priv->windows[i]);
+    LeaveCriticalSection(&present_priv->mutex_present);
 
-    PRESENTForceReleases(present_priv);
+    /* Once unregistered, the event thread doesn't touch present_priv anymore */
+    EnterCriticalSection(&connection->dispatch_lock);
+    for (i = 0; i < connection->privs_count; i++)
+    {
+        if (connection->privs[i] == present_priv)
+        {
+            connection->privs[i] = connection->privs[--connection->privs_count];
+            break;
+        }
+    }
+    LeaveCriticalSection(&connection->dispatch_lock);
 
-    current = present_priv->first_present_priv;
-    while (current)
+    EnterCriticalSection(&present_priv->mutex_present);
+
+    for (i = 0; i < present_priv->pixmap_table_size; i++)
     {
-        PRESENTPixmapPriv *next = current->next;
-        PRESENTDestroyPixmapContent(current);
-        HeapFree(GetProcessHeap(), 0, current);
-        current = next;
+        if (!present_priv->pixmap_table[i])
+            continue;
+        PRESENTDestroyPixmapContent(present_priv->pixmap_table[i]);
+        HeapFree(GetProcessHeap(), 0, present_priv->pixmap_table[i]);
     }
+    HeapFree(GetProcessHeap(), 0, present_priv->pixmap_table);
+
+    for (i = 0; i < PRESENT_WINDOW_CACHE_SIZE; i++)
+        PRESENTFreeXcbQueue(present_priv, &present_priv->windows[i]);
 
-    PRESENTFreeXcbQueue(present_priv);
+    if (present_priv->update_region)
+        xcb_xfixes_destroy_region(present_priv->xcb_connection_bis, present_priv->update_region);
+    if (present_priv->valid_region)
+        xcb_xfixes_destroy_region(present_priv->xcb_connection_bis, present_priv->valid_region);
+
+    /* One round trip for all the frees above */
+    free(xcb_get_input_focus_reply(present_priv->xcb_connection_bis,
+            xcb_get_input_focus(present_priv->xcb_connection_bis), NULL));
 
-    xcb_disconnect(present_priv->xcb_connection);
-    xcb_disconnect(present_priv->xcb_connection_bis);
     LeaveCriticalSection(&present_priv->mutex_present);
+
+    PRESENTreport_errors(present_priv);
     DeleteCriticalSection(&present_priv->mutex_present);
-    DeleteCriticalSection(&present_priv->mutex_xcb_wait);
 
+    PRESENTconnection_release(connection);
     HeapFree(GetProcessHeap(), 0, present_priv);
 }
 
+BOOL PRESENTGetGeometry(PRESENTpriv *present_priv, struct PRESENTGeometry *geom)
+{
+    LONG seq;
+
+    /* Seqlock: retry while the event thread updates it */
+    for (;;)
+    {
+        seq = InterlockedCompareExchange(&present_priv->geom_seq, 0, 0);
+        if (seq & 1)
+        {
+            YieldProcessor();
+            continue;
+        }
+        *geom = *(volatile struct PRESENTGeometry *)&present_priv->geom;
+        if (InterlockedCompareExchange(&present_priv->geom_seq, 0, 0) == seq)
+            break;
+    }
+    return geom->window != 0;
+}
+
 BOOL PRESENTGetGeom(PRESENTpriv *present_priv, XID window, int *width, int *height, int *depth)
 {
-    /* It is ok to have one or two bad frames.
-     * So do not flush events nor lock the mutex. */
-    if (present_priv && present_priv->window == window)
+    struct PRESENTGeometry geom;
+
+    if (present_priv && PRESENTGetGeometry(present_priv, &geom) && geom.window == window)
     {
-        *width = present_priv->last_width;
-        *height = present_priv->last_height;
-        *depth = present_priv->last_depth;
+        *width = geom.width;
+        *height = geom.height;
+        *depth = geom.depth;
         return TRUE;
     }
 
     return FALSE;
 }
 
-BOOL PRESENTGeomUpdated(PRESENTpriv *present_priv)
-{
-    return InterlockedExchange(&present_priv->win_updated, FALSE);
-}
-
 BOOL PRESENTPixmapCreate(PRESENTpriv *present_priv, int screen,
         Pixmap *pixmap, int width, int height, int stride, int depth,
         int bpp)
@@ -484,19 +1890,19 @@ BOOL PRESENTPixmapCreate(PRESENTpriv *present_priv, int screen,
 
     EnterCriticalSection(&present_priv->mutex_present);
 
-    xcb_screen = screen_of_display (present_priv->xcb_connection, screen);
+    xcb_screen = screen_of_display (present_priv->xcb_connection_bis, screen);
     if (!xcb_screen || !xcb_screen->root)
     {
         LeaveCriticalSection(&present_priv->mutex_present);
         return FALSE;
     }
 
-    *pixmap = xcb_generate_id(present_priv->xcb_connection);
+    *pixmap = xcb_generate_id(present_priv->xcb_connection_bis);
 
-    cookie = xcb_create_pixmap(present_priv->xcb_connection, depth,
+    cookie = xcb_create_pixmap(present_priv->xcb_connection_bis, depth,
                                *pixmap, xcb_screen->root, width, height);
 
-    error = xcb_request_check(present_priv->xcb_connection, cookie);
+    error = xcb_request_check(present_priv->xcb_connection_bis, cookie);
     LeaveCriticalSection(&present_priv->mutex_present);
 
     if (error)
@@ -504,157 +1910,410 @@ BOOL PRESENTPixmapCreate(PRESENTpriv *present_priv, int screen,
     return TRUE;
 }
 
-BOOL PRESENTPixmapInit(PRESENTpriv *present_priv, Pixmap pixmap, PRESENTPixmapPriv **present_pixmap_priv)
+static BOOL PRESENTpixmap_init(PRESENTpriv *present_priv, Pixmap pixmap, unsigned width,
+        unsigned height, unsigned depth, PRESENTPixmapPriv **present_pixmap_priv)
 {
-    xcb_get_geometry_cookie_t cookie;
-    xcb_get_geometry_reply_t *reply;
-
-    cookie = xcb_get_geometry(present_priv->xcb_connection, pixmap);
-    reply = xcb_get_geometry_reply(present_priv->xcb_connection, cookie, NULL);
-
-    if (!reply)
-        return FALSE;
-
     *present_pixmap_priv = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(PRESENTPixmapPriv));
 
     if (!*present_pixmap_priv)
-    {
-        free(reply);
         return FALSE;
-    }
+
     EnterCriticalSection(&present_priv->mutex_present);
 
     (*present_pixmap_priv)->released = TRUE;
     (*present_pixmap_priv)->pixmap = pixmap;
     (*present_pixmap_priv)->present_priv = present_priv;
-    (*present_pixmap_priv)->next = present_priv->first_present_priv;
-    (*present_pixmap_priv)->width = reply->width;
-    (*present_pixmap_priv)->height = reply->height;
-    (*present_pixmap_priv)->depth = reply->depth;
-    free(reply);
+    (*present_pixmap_priv)->width = width;
+    (*present_pixmap_priv)->height = height;
+    (*present_pixmap_priv)->depth = depth;
+    InitializeConditionVariable(&(*present_pixmap_priv)->released_cond);
 
     (*present_pixmap_priv)->serial = PRESENTGetNewSerial();
-    present_priv->first_present_priv = *present_pixmap_priv;
+    if (!PRESENTPixmapTableInsert(present_priv, *present_pixmap_priv))
+    {
+        LeaveCriticalSection(&present_priv->mutex_present);
+        HeapFree(GetProcessHeap(), 0, *present_pixmap_priv);
+        return FALSE;
+    }
 
     LeaveCriticalSection(&present_priv->mutex_present);
     return TRUE;
 }
 
+BOOL PRESENTPixmapInit(PRESENTpriv *present_priv, Pixmap pixmap, PRESENTPixmapPriv **present_pixmap_priv)
+{
+    xcb_get_geometry_cookie_t cookie;
+    xcb_get_geometry_reply_t *reply;
+    BOOL ret;
+
+    cookie = xcb_get_geometry(present_priv->xcb_connection_bis, pixmap);
+    reply = xcb_get_geometry_reply(present_priv->xcb_connection_bis, cookie, NULL);
+
+    if (!reply)
+        return FALSE;
+
+    ret = PRESENTpixmap_init(present_priv, pixmap, reply->width, reply->height,
+            reply->depth, present_pixmap_priv);
+    free(reply);
+    return ret;
+}
+
+BOOL PRESENTPixmapInitWithSize(PRESENTpriv *present_priv, Pixmap pixmap, int width, int height,
+        int depth, PRESENTPixmapPriv **present_pixmap_priv)
+{
+    return PRESENTpixmap_init(present_priv, pixmap, width, height, depth, present_pixmap_priv);
+}
+
+void PRESENTPixmapSetIdleFence(PRESENTPixmapPriv *present_pixmap_priv, XID fence,
+        struct xshmfence *shm_fence)
+{
+    PRESENTpriv *present_priv = present_pixmap_priv->present_priv;
+
+    EnterCriticalSection(&present_priv->mutex_present);
+    present_pixmap_priv->idle_fence = fence;
+    present_pixmap_priv->idle_fence_shm = shm_fence;
+    LeaveCriticalSection(&present_priv->mutex_present);
+}
+
 BOOL PRESENTTryFreePixmap(PRESENTPixmapPriv *present_pixmap_priv)
 {
     PRESENTpriv *present_priv = present_pixmap_priv->present_priv;
-    PRESENTPixmapPriv *current;
 
     EnterCriticalSection(&present_priv->mutex_present);
 
     if (!present_pixmap_priv->released || present_pixmap_priv->present_complete_pending)
     {
+        if (!present_pixmap_priv->free_pending)
+        {
+            present_pixmap_priv->free_pending = TRUE;
+            present_pixmap_priv->free_time = GetTickCount64();
+            present_priv->deferred_free_count++;
+        }
         LeaveCriticalSection(&present_priv->mutex_present);
         TRACE("Releasing pixmap priv %p later\n", present_pixmap_priv);
         return FALSE;
     }
 
-    if (present_priv->first_present_priv == present_pixmap_priv)
+    PRESENTfree_pixmap(present_priv, present_pixmap_priv);
+    LeaveCriticalSection(&present_priv->mutex_present);
+    return TRUE;
+}
+
+BOOL PRESENTHelperCopyFront(PRESENTPixmapPriv *present_pixmap_priv)
+{
+    PRESENTpriv *present_priv = present_pixmap_priv->present_priv;
+    xcb_void_cookie_t cookie;
+    xcb_generic_error_t *error;
+    uint32_t v = 0;
+    xcb_gcontext_t gc;
+
+    EnterCriticalSection(&present_priv->mutex_present);
+
+    if (!present_priv->window)
     {
-        present_priv->first_present_priv = present_pixmap_priv->next;
-        goto free_priv;
+        LeaveCriticalSection(&present_priv->mutex_present);
+        return FALSE;
+    }
+
+    gc = xcb_generate_id(present_priv->xcb_connection_bis);
+    xcb_create_gc(present_priv->xcb_connection_bis, gc, present_priv->window,
+             XCB_GC_GRAPHICS_EXPOSURES, &v);
+
+    cookie = xcb_copy_area_checked(present_priv->xcb_connection_bis,
+             present_priv->window, present_pixmap_priv->pixmap, gc,
+             0, 0, 0, 0, present_pixmap_priv->width, present_pixmap_priv->height);
+
+    error = xcb_request_check(present_priv->xcb_connection_bis, cookie);
+    xcb_free_gc(present_priv->xcb_connection_bis, gc);
+    LeaveCriticalSection(&present_priv->mutex_present);
+    return (error != NULL);
+}
+
+BOOL PRESENTPixmapPrepare(XID window, PRESENTPixmapPriv *present_pixmap_priv)
+{
+    PRESENTpriv *present_priv = present_pixmap_priv->present_priv;
+
+    EnterCriticalSection(&present_priv->mutex_present);
+
+    if (window != present_priv->window)
+    {
+        uint64_t start = PRESENTnow();
+
+        PRESENTPrivChangeWindow(present_priv, window);
+        present_priv->timings.window_changes++;
+        present_priv->timings.window_change_time += PRESENTnow() - start;
+    }
+
+    if (!window)
+    {
+        ERR("ERROR: Try to Present a pixmap on a NULL window\n");
+        LeaveCriticalSection(&present_priv->mutex_present);
+        return FALSE;
+    }
+
+    /* Note: present_pixmap_priv->present_complete_pending may be non-0, because
+     * on some paths the Xserver sends the complete event just after the idle
+     * event. PRESENTIsPixmapReleased may have seen the release on the idle
+     * fence only. */
+    if (!PRESENTcheck_fence(present_priv, present_pixmap_priv))
+    {
+        ERR("FATAL ERROR: Trying to Present a pixmap not released\n");
+        LeaveCriticalSection(&present_priv->mutex_present);
+        return FALSE;
     }
 
-    current = present_priv->first_present_priv;
-    while (current->next != present_pixmap_priv)
-        current = current->next;
-    current->next = present_pixmap_priv->next;
-free_priv:
-    PRESENTDestroyPixmapContent(present_pixmap_priv);
-    HeapFree(GetProcessHeap(), 0, present_pixmap_priv);
     LeaveCriticalSection(&present_priv->mutex_present);
     return TRUE;
 }
 
-BOOL PRESENTHelperCopyFront(PRESENTPixmapPriv *present_pixmap_priv)
+static LONGLONG PRESENTrect_area(const RECT *rect)
+{
+    return (LONGLONG)(rect->right - rect->left) * (rect->bottom - rect->top);
+}
+
+/* Clamps the rectangles to the pixmap and merges the ones overlapping or
+ * close enough that their bounding box wastes little. Returns the new count. */
+static unsigned PRESENTsimplify_rects(RECT *rects, unsigned nrects, LONG width, LONG height)
+{
+    LONGLONG area = 0, overlap;
+    RECT clip, bounds, merged, inter;
+    unsigned i, j, n = 0;
+
+    SetRect(&clip, 0, 0, width, height);
+    for (i = 0; i < nrects; i++)
+    {
+        if (IntersectRect(&rects[n], &rects[i], &clip))
+            n++;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        for (j = i + 1; j < n; j++)
+        {
+            UnionRect(&merged, &rects[i], &rects[j]);
+            overlap = IntersectRect(&inter, &rects[i], &rects[j]) ? PRESENTrect_area(&inter) : 0;
+            /* Not more than an eighth of the bounding box isn't dirty */
+            if ((PRESENTrect_area(&merged) - PRESENTrect_area(&rects[i]) - PRESENTrect_area(&rects[j]) +
+                 overlap) * 8 > PRESENTrect_area(&merged))
+                continue;
+            rects[i] = merged;
+            rects[j] = rects[--n];
+            /* rects[i] grew, it may reach the ones already looked at */
+            j = i;
+        }
+    }
+
+    if (n <= 1)
+        return n;
+
+    SetRectEmpty(&bounds);
+    for (i = 0; i < n; i++)
+    {
+        UnionRect(&bounds, &bounds, &rects[i]);
+        area += PRESENTrect_area(&rects[i]);
+    }
+    /* The server is faster with a single rectangle covering mostly dirty pixels */
+    if (n > PRESENT_MAX_UPDATE_RECTS || area * 4 >= PRESENTrect_area(&bounds) * 3)
+    {
+        rects[0] = bounds;
+        n = 1;
+    }
+    return n;
+}
+
+/* Converts the dirty region to at most PRESENT_MAX_UPDATE_RECTS rectangles in rects */
+static unsigned PRESENTdirty_rects(const RGNDATA *region, LONG width, LONG height,
+        xcb_rectangle_t *rects)
+{
+    RECT dirty[PRESENT_MAX_DIRTY_RECTS], rc;
+    unsigned i, n = region->rdh.nCount;
+
+    if (n > PRESENT_MAX_DIRTY_RECTS)
+    {
+        SetRectEmpty(&dirty[0]);
+        for (i = 0; i < region->rdh.nCount; i++)
+        {
+            memcpy(&rc, region->Buffer + i * sizeof(RECT), sizeof(RECT));
+            UnionRect(&dirty[0], &dirty[0], &rc);
+        }
+        n = 1;
+    }
+    else
+        memcpy(dirty, region->Buffer, n * sizeof(RECT));
+
+    n = PRESENTsimplify_rects(dirty, n, width, height);
+    for (i = 0; i < n; i++)
+    {
+        rects[i].x = dirty[i].left;
+        rects[i].y = dirty[i].top;
+        rects[i].width = dirty[i].right - dirty[i].left;
+        rects[i].height = dirty[i].bottom - dirty[i].top;
+    }
+    return n;
+}
+
+/* Must be called with mutex_present held.
+ * The Xserver copies the regions when it queues a present, so they
+ * can be modified right after. Only send a request if the content changes. */
+static xcb_xfixes_region_t PRESENTUpdateRegion(PRESENTpriv *present_priv, xcb_xfixes_region_t *region,
+        xcb_rectangle_t *current, unsigned *ncurrent, const xcb_rectangle_t *rects, unsigned nrects)
+{
+    if (!*region)
+    {
+        *region = xcb_generate_id(present_priv->xcb_connection_bis);
+        xcb_xfixes_create_region(present_priv->xcb_connection_bis, *region, nrects, rects);
+    }
+    else if (nrects != *ncurrent || memcmp(current, rects, nrects * sizeof(*rects)))
+    {
+        xcb_xfixes_set_region(present_priv->xcb_connection_bis, *region, nrects, rects);
+    }
+    else
+        return *region;
+
+    memcpy(current, rects, nrects * sizeof(*rects));
+    *ncurrent = nrects;
+    return *region;
+}
+
+/* Must be called with mutex_present held */
+static BOOL PRESENTrefresh_period(PRESENTpriv *present_priv, uint64_t *period)
 {
-    PRESENTpriv *present_priv = present_pixmap_priv->present_priv;
-    xcb_void_cookie_t cookie;
-    xcb_generic_error_t *error;
-    uint32_t v = 0;
-    xcb_gcontext_t gc;
-
-    EnterCriticalSection(&present_priv->mutex_present);
+    struct PRESENTVblank *first, *last;
 
-    if (!present_priv->window)
-    {
-        LeaveCriticalSection(&present_priv->mutex_present);
+    if (present_priv->vblank_count < 2)
         return FALSE;
-    }
 
-    gc = xcb_generate_id(present_priv->xcb_connection);
-    xcb_create_gc(present_priv->xcb_connection, gc, present_priv->window,
-             XCB_GC_GRAPHICS_EXPOSURES, &v);
+    last = &present_priv->vblank_ring[(present_priv->vblank_count - 1) % PRESENT_VBLANK_RING_SIZE];
+    if (present_priv->vblank_count > PRESENT_VBLANK_RING_SIZE)
+        first = &present_priv->vblank_ring[present_priv->vblank_count % PRESENT_VBLANK_RING_SIZE];
+    else
+        first = &present_priv->vblank_ring[0];
 
-    cookie = xcb_copy_area_checked(present_priv->xcb_connection,
-             present_priv->window, present_pixmap_priv->pixmap, gc,
-             0, 0, 0, 0, present_pixmap_priv->width, present_pixmap_priv->height);
+    if (last->msc <= first->msc || last->ust <= first->ust)
+        return FALSE;
 
-    error = xcb_request_check(present_priv->xcb_connection, cookie);
-    xcb_free_gc(present_priv->xcb_connection, gc);
-    LeaveCriticalSection(&present_priv->mutex_present);
-    return (error != NULL);
+    *period = (last->ust - first->ust) / (last->msc - first->msc);
+    return TRUE;
 }
 
-BOOL PRESENTPixmapPrepare(XID window, PRESENTPixmapPriv *present_pixmap_priv)
+/* Must be called with mutex_present held.
+ * Extrapolates the current msc from the last known vblank,
+ * the server's ust is CLOCK_MONOTONIC in microseconds. */
+static uint64_t PRESENTestimate_msc(PRESENTpriv *present_priv, struct PRESENTWindow *win)
 {
-    PRESENTpriv *present_priv = present_pixmap_priv->present_priv;
+    struct PRESENTVblank *last;
+    uint64_t period, now;
 
-    EnterCriticalSection(&present_priv->mutex_present);
+    if (!PRESENTrefresh_period(present_priv, &period))
+        return win->last_msc;
 
-    if (window != present_priv->window)
-        PRESENTPrivChangeWindow(present_priv, window);
+    last = &present_priv->vblank_ring[(present_priv->vblank_count - 1) % PRESENT_VBLANK_RING_SIZE];
+    now = PRESENTnow();
+    if (now <= last->ust)
+        return last->msc;
 
-    if (!window)
-    {
-        ERR("ERROR: Try to Present a pixmap on a NULL window\n");
-        LeaveCriticalSection(&present_priv->mutex_present);
-        return FALSE;
-    }
+    return last->msc + (now - last->ust) / period;
+}
 
-    PRESENTflush_events(present_priv, FALSE);
-    /* Note: present_pixmap_priv->present_complete_pending may be non-0, because
-     * on some paths the Xserver sends the complete event just after the idle
-     * event. */
-    if (!present_pixmap_priv->released)
-    {
-        ERR("FATAL ERROR: Trying to Present a pixmap not released\n");
-        LeaveCriticalSection(&present_priv->mutex_present);
-        return FALSE;
-    }
+/* Must be called with mutex_present held.
+ * Returns the PRESENTnow() at which the crtc showing win should reach msc. */
+static uint64_t PRESENTmsc_time(PRESENTpriv *present_priv, struct PRESENTWindow *win, uint64_t msc)
+{
+    struct PRESENTVblank *last;
+    uint64_t period, time, now = PRESENTnow();
 
-    LeaveCriticalSection(&present_priv->mutex_present);
-    return TRUE;
+    if (!PRESENTrefresh_period(present_priv, &period))
+        return now + (msc > win->last_msc ? msc - win->last_msc : 1) * PRESENT_DEFAULT_REFRESH_PERIOD;
+
+    last = &present_priv->vblank_ring[(present_priv->vblank_count - 1) % PRESENT_VBLANK_RING_SIZE];
+    time = last->ust + (msc > last->msc ? msc - last->msc : 1) * period;
+    return max(time, now);
+}
+
+/* Must be called with mutex_present held, once the present is sent.
+ * Its events are expected from now on. */
+static void PRESENTpixmap_sent(PRESENTpriv *present_priv, struct PRESENTWindow *win,
+        PRESENTPixmapPriv *present_pixmap_priv, unsigned int sequence, UINT interval,
+        uint64_t target_msc, uint32_t options, uint64_t start)
+{
+    present_pixmap_priv->present_sequence = sequence;
+    present_pixmap_priv->present_window = win->window;
+    present_pixmap_priv->present_interval = interval;
+    present_pixmap_priv->present_pending = present_priv->pixmap_present_pending;
+    present_pixmap_priv->present_count = ++present_priv->present_count;
+    present_pixmap_priv->present_target_msc = target_msc;
+    present_pixmap_priv->present_options = options;
+    present_pixmap_priv->present_time = start;
+    present_pixmap_priv->present_expected = PRESENTmsc_time(present_priv, win, target_msc);
+    present_priv->events_expected = max(present_priv->events_expected, present_pixmap_priv->present_expected);
+    present_pixmap_priv->resync_copy_sent = FALSE;
+    win->last_target = target_msc;
+    win->present_pending++;
+    present_priv->pixmap_present_pending++;
+    present_pixmap_priv->present_complete_pending++;
+    InterlockedExchange(&present_pixmap_priv->released, FALSE);
+
+    if (!present_priv->timings.presents++)
+        present_priv->timings.first_present = start;
 }
 
 BOOL PRESENTPixmap(XID window, PRESENTPixmapPriv *present_pixmap_priv,
-        const UINT PresentationInterval, const BOOL PresentAsync, const BOOL SwapEffectCopy,
-        const RECT *pSourceRect, const RECT *pDestRect, const RGNDATA *pDirtyRegion)
+        const UINT PresentationInterval, const BOOL PresentAsync, const BOOL PresentMailbox,
+        const BOOL SwapEffectCopy, const RECT *pSourceRect, const RECT *pDestRect,
+        const RGNDATA *pDirtyRegion)
 {
     PRESENTpriv *present_priv = present_pixmap_priv->present_priv;
     xcb_void_cookie_t cookie;
-    xcb_generic_error_t *error;
     int64_t target_msc, presentationInterval;
     xcb_xfixes_region_t valid, update;
     int16_t x_off, y_off;
     uint32_t options = XCB_PRESENT_OPTION_NONE;
+    struct PRESENTWindow *win;
+    BOOL report_errors;
+    uint64_t start = PRESENTnow();
 
     EnterCriticalSection(&present_priv->mutex_present);
 
-    target_msc = present_priv->last_msc;
+    win = PRESENTfind_window(present_priv, window);
+    if (!win)
+    {
+        ERR("Window %lx wasn't prepared for presenting\n", (unsigned long)window);
+        LeaveCriticalSection(&present_priv->mutex_present);
+        return FALSE;
+    }
+
+    target_msc = win->last_msc;
+
+    PRESENTupdate_capabilities(present_priv, win);
 
     presentationInterval = PresentationInterval;
     if (PresentAsync)
         options |= XCB_PRESENT_OPTION_ASYNC;
-    if (SwapEffectCopy)
+    /* Without async flips the server copies anyway, skip its flip checks */
+    if (SwapEffectCopy ||
+        (PresentAsync && !(win->capabilities & XCB_PRESENT_CAPABILITY_ASYNC)))
         options |= XCB_PRESENT_OPTION_COPY;
+    if (options != win->last_options)
+    {
+        TRACE("Window %lx: capabilities %#x, presenting with options %#x\n",
+              (unsigned long)window, win->capabilities, options);
+        win->last_options = options;
+    }
+
+    target_msc += presentationInterval * (win->present_pending + 1);
 
-    target_msc += presentationInterval * (present_priv->pixmap_present_pending + 1);
+    /* Mailbox: target the next vblank. A present still queued for it
+     * is replaced by the server and completes with MODE_SKIP. */
+    if (PresentMailbox)
+    {
+        if (win->present_pending)
+        {
+            target_msc = win->last_target;
+            present_priv->mailbox_replaced++;
+        }
+        else
+            target_msc = PRESENTestimate_msc(present_priv, win) + 1;
+    }
 
     /* Note: PRESENT defines some way to do partial copy:
      * presentproto:
@@ -672,8 +2331,8 @@ BOOL PRESENTPixmap(XID window, PRESENTPixmapPriv *present_pixmap_priv,
     else
     {
         xcb_rectangle_t rect_update;
-        xcb_rectangle_t *rect_updates;
-        int i;
+        xcb_rectangle_t rect_updates[PRESENT_MAX_UPDATE_RECTS];
+        unsigned nrects = 1;
 
         rect_update.x = 0;
         rect_update.y = 0;
@@ -699,78 +2358,41 @@ BOOL PRESENTPixmap(XID window, PRESENTPixmapPriv *present_pixmap_priv,
             /* Note: the size of pDestRect and pSourceRect are supposed to be the same size
              * because the driver would have done things to assure that. */
         }
-        valid = xcb_generate_id(present_priv->xcb_connection_bis);
-        update = xcb_generate_id(present_priv->xcb_connection_bis);
-        xcb_xfixes_create_region(present_priv->xcb_connection_bis, valid, 1, &rect_update);
-        if (pDirtyRegion && pDirtyRegion->rdh.nCount)
-        {
-            rect_updates = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
-                    sizeof(xcb_rectangle_t) * pDirtyRegion->rdh.nCount);
+        valid = PRESENTUpdateRegion(present_priv, &present_priv->valid_region,
+                &present_priv->valid_rect, &present_priv->valid_nrects, &rect_update, 1);
 
-            for (i = 0; i < pDirtyRegion->rdh.nCount; i++)
-            {
-                RECT rc;
-                memcpy(&rc, pDirtyRegion->Buffer + i * sizeof(RECT), sizeof(RECT));
-                rect_update.x = rc.left;
-                rect_update.y = rc.top;
-                rect_update.width = rc.right - rc.left;
-                rect_update.height = rc.bottom - rc.top;
-                memcpy(rect_updates + i * sizeof(xcb_rectangle_t), &rect_update, sizeof(xcb_rectangle_t));
-            }
-            xcb_xfixes_create_region(present_priv->xcb_connection_bis, update, pDirtyRegion->rdh.nCount, rect_updates);
-            HeapFree(GetProcessHeap(), 0, rect_updates);
-        } else
-            xcb_xfixes_create_region(present_priv->xcb_connection_bis, update, 1, &rect_update);
+        rect_updates[0] = rect_update;
+        if (pDirtyRegion && pDirtyRegion->rdh.nCount)
+            nrects = PRESENTdirty_rects(pDirtyRegion, present_pixmap_priv->width,
+                    present_pixmap_priv->height, rect_updates);
+        update = PRESENTUpdateRegion(present_priv, &present_priv->update_region,
+                present_priv->update_rects, &present_priv->update_nrects, rect_updates, nrects);
     }
 
-    cookie = xcb_present_pixmap_checked(present_priv->xcb_connection_bis,
-            window, present_pixmap_priv->pixmap, present_pixmap_priv->serial,
-            valid, update, x_off, y_off, None, None, None, options,
-            target_msc, 0, 0, 0, NULL);
-    error = xcb_request_check(present_priv->xcb_connection_bis, cookie); /* performs a flush */
-
-    if (update)
-        xcb_xfixes_destroy_region(present_priv->xcb_connection_bis, update);
-    if (valid)
-        xcb_xfixes_destroy_region(present_priv->xcb_connection_bis, valid);
-
-    if (error)
-    {
-        xcb_get_geometry_cookie_t cookie_geom;
-        xcb_get_geometry_reply_t *reply;
-
-        cookie_geom = xcb_get_geometry(present_priv->xcb_connection_bis, window);
-        reply = xcb_get_geometry_reply(present_priv->xcb_connection_bis, cookie_geom, NULL);
+    /* The server triggers the idle fence when it is done with the pixmap */
+    PRESENTfence_reset(present_pixmap_priv);
 
-        ERR("Error using PRESENT. Here some debug info\n");
-        if (!reply)
-        {
-            ERR("Error querying window info. Perhaps it doesn't exist anymore\n");
-            LeaveCriticalSection(&present_priv->mutex_present);
-            return FALSE;
-        }
-        ERR("Pixmap: width=%d, height=%d, depth=%d\n",
-            present_pixmap_priv->width, present_pixmap_priv->height,
-            present_pixmap_priv->depth);
+    /* Don't wait for the result, errors are handled by PRESENTcollect_errors */
+    cookie = xcb_present_pixmap(present_priv->xcb_connection_bis,
+            window, present_pixmap_priv->pixmap, present_pixmap_priv->serial,
+            valid, update, x_off, y_off, None, None, present_pixmap_priv->idle_fence,
+            options, target_msc, 0, 0, 0, NULL);
+    xcb_flush(present_priv->xcb_connection_bis);
 
-        ERR("Window: width=%d, height=%d, depth=%d, x=%d, y=%d\n",
-            (int) reply->width, (int) reply->height,
-            (int) reply->depth, (int) reply->x, (int) reply->y);
+    if (present_record_log)
+        PRESENTrecord_pixmap(present_priv, present_pixmap_priv, window, update, target_msc, options);
 
-        ERR("Present parameter: PresentationInterval=%d, Pending presentations=%d\n",
-            PresentationInterval, present_priv->pixmap_present_pending);
+    PRESENTpixmap_sent(present_priv, win, present_pixmap_priv, cookie.sequence,
+            PresentationInterval, target_msc, options, start);
 
-        if (present_pixmap_priv->depth != reply->depth)
-            ERR("Depths are different. PRESENT needs the pixmap and the window have same depth\n");
-        free(reply);
-        LeaveCriticalSection(&present_priv->mutex_present);
-        return FALSE;
-    }
-    present_priv->last_target = target_msc;
-    present_priv->pixmap_present_pending++;
-    present_pixmap_priv->present_complete_pending++;
-    present_pixmap_priv->released = FALSE;
+    present_priv->timings.last_present = PRESENTnow();
+    present_priv->timings.present_time += present_priv->timings.last_present - start;
+    /* Errors of earlier presents, they don't fail this one */
+    report_errors = present_priv->error_reports_count || present_priv->error_reports_lost;
     LeaveCriticalSection(&present_priv->mutex_present);
+
+    if (report_errors)
+        PRESENTreport_errors(present_priv);
     return TRUE;
 }
 
@@ -780,79 +2402,381 @@ BOOL PRESENTWaitPixmapReleased(PRESENTPixmapPriv *present_pixmap_priv)
 
     EnterCriticalSection(&present_priv->mutex_present);
 
-    PRESENTflush_events(present_priv, FALSE);
-
     /* The part with present_pixmap_priv->present_complete_pending is legacy behaviour.
      * It matters for SwapEffectCopy with swapinterval > 0. */
-    while (!present_pixmap_priv->released || present_pixmap_priv->present_complete_pending)
+    while (!PRESENTcheck_fence(present_priv, present_pixmap_priv) ||
+           (present_pixmap_priv->present_complete_pending &&
+            (present_pixmap_priv->present_options & XCB_PRESENT_OPTION_COPY) &&
+            present_pixmap_priv->present_interval))
     {
-        /* Note: following if should not happen because we'll never
-         * use two PRESENTWaitPixmapReleased in parallels on same window.
-         * However it would make it work in that case */
-        if (present_priv->xcb_wait)
+        /* The idle fence is triggered before the IdleNotify event makes it
+         * through the event thread, so poll it between short waits. The
+         * server may also free it untriggered, the events still come then. */
+        if (!PRESENTwait_events_for(present_priv, &present_pixmap_priv->released_cond,
+                present_pixmap_priv->idle_fence_shm && !present_pixmap_priv->released ?
+                PRESENT_FENCE_POLL_INTERVAL : INFINITE))
         {
-            /* we allow only one thread to dispatch events */
-            EnterCriticalSection(&present_priv->mutex_xcb_wait);
-            /* here the other thread got an event but hasn't treated it yet */
-            LeaveCriticalSection(&present_priv->mutex_xcb_wait);
             LeaveCriticalSection(&present_priv->mutex_present);
-            Sleep(10); /* Let it treat the event */
-            EnterCriticalSection(&present_priv->mutex_present);
+            return FALSE;
         }
-        else if (!PRESENTwait_events(present_priv, TRUE))
+    }
+    LeaveCriticalSection(&present_priv->mutex_present);
+    return TRUE;
+}
+
+/* Called in loops by the driver looking for a free buffer,
+ * thus it doesn't wait for the thread presenting. */
+BOOL PRESENTIsPixmapReleased(PRESENTPixmapPriv *present_pixmap_priv)
+{
+    /* Set once the buffer can be reused, the full barrier orders the
+     * reads of the caller after it. Failed presents get released by
+     * PRESENTwait_events, when the driver waits for a release event. */
+    if (InterlockedCompareExchange(&present_pixmap_priv->released, FALSE, FALSE))
+        return TRUE;
+
+    /* Released by the server, PRESENTPixmapPrepare catches up */
+    return PRESENTfence_query(present_pixmap_priv);
+}
+
+BOOL PRESENTWaitReleaseEvent(PRESENTpriv *present_priv)
+{
+
+    EnterCriticalSection(&present_priv->mutex_present);
+
+    while (!present_priv->idle_notify_since_last_check)
+    {
+        if (!PRESENTwait_events(present_priv, &present_priv->event_cond))
         {
+            ERR("Issue in PRESENTWaitReleaseEvent\n");
             LeaveCriticalSection(&present_priv->mutex_present);
             return FALSE;
         }
     }
+    present_priv->idle_notify_since_last_check = FALSE;
+
     LeaveCriticalSection(&present_priv->mutex_present);
     return TRUE;
 }
 
-BOOL PRESENTIsPixmapReleased(PRESENTPixmapPriv *present_pixmap_priv)
+BOOL PRESENTGetStats(PRESENTpriv *present_priv, struct PRESENTStats *stats)
+{
+    BOOL ret = FALSE;
+
+    EnterCriticalSection(&present_priv->mutex_present);
+
+    if (present_priv->stats_count)
+    {
+        *stats = present_priv->stats_ring[(present_priv->stats_count - 1) % PRESENT_STATS_RING_SIZE];
+        stats->sync_msc = stats->msc;
+        stats->sync_ust = stats->ust;
+        /* NotifyMSC events may have come since */
+        if (present_priv->vblank_count)
+        {
+            struct PRESENTVblank *last =
+                    &present_priv->vblank_ring[(present_priv->vblank_count - 1) % PRESENT_VBLANK_RING_SIZE];
+
+            if (last->msc > stats->msc)
+            {
+                stats->sync_msc = last->msc;
+                stats->sync_ust = last->ust;
+            }
+        }
+        ret = TRUE;
+    }
+
+    LeaveCriticalSection(&present_priv->mutex_present);
+    return ret;
+}
+
+/* Must be called with mutex_present held and a current window.
+ * Gets the msc and ust of the next vblank into the vblank model. At most
+ * one NotifyMSC is sent per PRESENT_VBLANK_MAX_AGE, its event may be
+ * lost with the window. */
+static void PRESENTrequest_vblank(PRESENTpriv *present_priv)
+{
+    uint64_t now = PRESENTnow();
+
+    if (present_priv->vblank_request_time &&
+        now < present_priv->vblank_request_time + PRESENT_VBLANK_MAX_AGE)
+        return;
+
+    /* divisor 1 and a past target_msc: the next msc. Errors are logged by the event thread. */
+    xcb_present_notify_msc(present_priv->xcb_connection_bis, present_priv->window, 0, 0, 1, 0);
+    xcb_flush(present_priv->xcb_connection_bis);
+    present_priv->vblank_request_time = now;
+    present_priv->events_expected = max(present_priv->events_expected,
+            PRESENTmsc_time(present_priv, present_priv->current, present_priv->current->last_msc + 1));
+}
+
+BOOL PRESENTGetVBlankPhase(PRESENTpriv *present_priv, uint64_t *elapsed, uint64_t *period)
+{
+    struct PRESENTVblank *last;
+    uint64_t now;
+    BOOL ret = FALSE;
+
+    EnterCriticalSection(&present_priv->mutex_present);
+
+    now = PRESENTnow();
+    if (PRESENTrefresh_period(present_priv, period) && *period)
+    {
+        last = &present_priv->vblank_ring[(present_priv->vblank_count - 1) % PRESENT_VBLANK_RING_SIZE];
+        *elapsed = now > last->ust ? (now - last->ust) % *period : 0;
+        ret = TRUE;
+    }
+
+    /* Let the model follow the drift of the clocks without waiting */
+    if (present_priv->current && (!present_priv->vblank_count ||
+        now > present_priv->vblank_ring[(present_priv->vblank_count - 1) % PRESENT_VBLANK_RING_SIZE].ust +
+              PRESENT_VBLANK_MAX_AGE))
+        PRESENTrequest_vblank(present_priv);
+
+    LeaveCriticalSection(&present_priv->mutex_present);
+    return ret;
+}
+
+BOOL PRESENTGetRefreshPeriod(PRESENTpriv *present_priv, uint64_t *period)
 {
-    PRESENTpriv *present_priv = present_pixmap_priv->present_priv;
     BOOL ret;
 
     EnterCriticalSection(&present_priv->mutex_present);
+    ret = PRESENTrefresh_period(present_priv, period);
+    LeaveCriticalSection(&present_priv->mutex_present);
+    return ret;
+}
+
+BOOL PRESENTHasAsyncFlip(PRESENTpriv *present_priv)
+{
+    BOOL ret = FALSE;
 
-    PRESENTflush_events(present_priv, FALSE);
+    EnterCriticalSection(&present_priv->mutex_present);
+    if (present_priv->current)
+    {
+        PRESENTupdate_capabilities(present_priv, present_priv->current);
+        ret = !!(present_priv->current->capabilities & XCB_PRESENT_CAPABILITY_ASYNC);
+    }
+    LeaveCriticalSection(&present_priv->mutex_present);
+    return ret;
+}
 
-    ret = present_pixmap_priv->released;
+BOOL PRESENTGetPresentMode(PRESENTpriv *present_priv, UINT *capabilities, UINT *options)
+{
+    BOOL ret = FALSE;
 
+    EnterCriticalSection(&present_priv->mutex_present);
+    if (present_priv->current)
+    {
+        *capabilities = present_priv->current->capabilities;
+        *options = present_priv->current->last_options;
+        ret = TRUE;
+    }
     LeaveCriticalSection(&present_priv->mutex_present);
     return ret;
 }
 
-BOOL PRESENTWaitReleaseEvent(PRESENTpriv *present_priv)
+BOOL PRESENTIsLate(PRESENTpriv *present_priv)
 {
+    BOOL ret;
 
     EnterCriticalSection(&present_priv->mutex_present);
+    ret = present_priv->last_present_late;
+    LeaveCriticalSection(&present_priv->mutex_present);
+    return ret;
+}
 
-    while (!present_priv->idle_notify_since_last_check)
+void PRESENTGetDeferredFrees(PRESENTpriv *present_priv, UINT *count, DWORD *oldest_age)
+{
+    ULONGLONG now = GetTickCount64(), oldest = now;
+    unsigned i;
+
+    EnterCriticalSection(&present_priv->mutex_present);
+    *count = present_priv->deferred_free_count;
+    for (i = 0; *count && i < present_priv->pixmap_table_size; i++)
     {
-        /* Note: following if should not happen because we'll never
-         * use two PRESENTWaitPixmapReleased in parallels on same window.
-         * However it would make it work in that case */
-        if (present_priv->xcb_wait)
-        {
-            /* we allow only one thread to dispatch events */
-            EnterCriticalSection(&present_priv->mutex_xcb_wait);
-            /* here the other thread got an event but hasn't treated it yet */
-            LeaveCriticalSection(&present_priv->mutex_xcb_wait);
-            LeaveCriticalSection(&present_priv->mutex_present);
-            Sleep(10); /* Let it treat the event */
-            EnterCriticalSection(&present_priv->mutex_present);
-        }
-        else if (!PRESENTwait_events(present_priv, TRUE))
+        if (present_priv->pixmap_table[i] && present_priv->pixmap_table[i]->free_pending &&
+            present_priv->pixmap_table[i]->free_time < oldest)
+            oldest = present_priv->pixmap_table[i]->free_time;
+    }
+    LeaveCriticalSection(&present_priv->mutex_present);
+    *oldest_age = now - oldest;
+}
+
+void PRESENTGetTimings(PRESENTpriv *present_priv, struct PRESENTTimings *timings)
+{
+    EnterCriticalSection(&present_priv->mutex_present);
+    *timings = present_priv->timings;
+    LeaveCriticalSection(&present_priv->mutex_present);
+}
+
+void PRESENTGetSkipCounters(PRESENTpriv *present_priv, UINT *replaced, UINT *skipped)
+{
+    EnterCriticalSection(&present_priv->mutex_present);
+    *replaced = present_priv->mailbox_replaced;
+    *skipped = present_priv->skipped_count;
+    LeaveCriticalSection(&present_priv->mutex_present);
+}
+
+BOOL PRESENTWaitPendingPresents(PRESENTpriv *present_priv, int max_pending, BOOL dont_wait)
+{
+    EnterCriticalSection(&present_priv->mutex_present);
+
+    while (present_priv->pixmap_present_pending >= max_pending)
+    {
+        if (dont_wait)
         {
-            ERR("Issue in PRESENTWaitReleaseEvent\n");
             LeaveCriticalSection(&present_priv->mutex_present);
             return FALSE;
         }
+        /* Don't block presenting if the events are broken */
+        if (!PRESENTwait_events(present_priv, &present_priv->event_cond))
+            break;
     }
-    present_priv->idle_notify_since_last_check = FALSE;
 
     LeaveCriticalSection(&present_priv->mutex_present);
     return TRUE;
 }
+
+#ifdef D3D9NINE_PRESENT_REPLAY
+/* The serials PRESENTdrop_present hands out must not be ones of the log */
+static void PRESENTreplay_reserve_serial(uint32_t serial)
+{
+    LONG last;
+
+    while ((last = InterlockedCompareExchange(&last_serial_given, 0, 0)) < (LONG)serial &&
+           InterlockedCompareExchange(&last_serial_given, serial, last) != last);
+}
+
+/* Must be called with mutex_present held.
+ * Does what PRESENTPrivChangeWindow and PRESENTPixmap do, without X server. */
+static void PRESENTreplay_pixmap(PRESENTpriv *present_priv, const struct present_record *record)
+{
+    PRESENTPixmapPriv *present_pixmap_priv;
+    struct PRESENTWindow *win;
+
+    win = PRESENTfind_window(present_priv, record->window);
+    if (!win)
+    {
+        /* PRESENTForceReleases already waited for the presents to the evicted window */
+        win = PRESENTwindow_slot(present_priv);
+        memset(win, 0, sizeof(*win));
+        win->window = record->window;
+    }
+    win->last_use = ++present_priv->window_use_count;
+    present_priv->current = win;
+    present_priv->window = win->window;
+
+    present_pixmap_priv = PRESENTFindPixmapPriv(present_priv, record->serial);
+    if (!present_pixmap_priv)
+    {
+        /* No pixmap, its IdleNotify events carry pixmap 0 as well */
+        present_pixmap_priv = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(PRESENTPixmapPriv));
+        if (!present_pixmap_priv)
+            return;
+        present_pixmap_priv->present_priv = present_priv;
+        present_pixmap_priv->released = TRUE;
+        present_pixmap_priv->serial = record->serial;
+        InitializeConditionVariable(&present_pixmap_priv->released_cond);
+        if (!PRESENTPixmapTableInsert(present_priv, present_pixmap_priv))
+        {
+            HeapFree(GetProcessHeap(), 0, present_pixmap_priv);
+            return;
+        }
+        PRESENTreplay_reserve_serial(record->serial);
+    }
+
+    /* The interval isn't recorded, only PRESENTWaitPixmapReleased needs it */
+    PRESENTpixmap_sent(present_priv, win, present_pixmap_priv, record->seq, 0,
+            record->msc, record->options, PRESENTnow());
+}
+
+/* Must be called with mutex_present held */
+static void PRESENTreplay_record(PRESENTpriv *present_priv, const struct present_record *record)
+{
+    PRESENTPixmapPriv *present_pixmap_priv;
+    xcb_present_generic_event_t *ge;
+    xcb_present_complete_notify_event_t *ce;
+    xcb_present_idle_notify_event_t *ie;
+
+    switch (record->type)
+    {
+        case PRESENT_RECORD_PIXMAP:
+            PRESENTreplay_pixmap(present_priv, record);
+            break;
+        case PRESENT_RECORD_COMPLETE:
+            /* Freed by PRESENThandle_events, like the events of xcb */
+            ge = calloc(1, sizeof(*ce));
+            if (!ge)
+                break;
+            ce = (void *) ge;
+            ce->response_type = XCB_GE_GENERIC;
+            ce->event_type = XCB_PRESENT_COMPLETE_NOTIFY;
+            ce->kind = record->kind;
+            ce->mode = record->mode;
+            ce->window = record->window;
+            ce->serial = record->serial;
+            ce->msc = record->msc;
+            ce->ust = record->ust;
+            PRESENTdispatch_event(present_priv, ge);
+            break;
+        case PRESENT_RECORD_IDLE:
+            ge = calloc(1, sizeof(*ie));
+            if (!ge)
+                break;
+            ie = (void *) ge;
+            ie->response_type = XCB_GE_GENERIC;
+            ie->event_type = XCB_PRESENT_EVENT_IDLE_NOTIFY;
+            ie->window = record->window;
+            ie->serial = record->serial;
+            PRESENTdispatch_event(present_priv, ge);
+            break;
+        case PRESENT_RECORD_ERROR:
+            present_pixmap_priv = PRESENTFindPixmapPriv(present_priv, record->serial);
+            if (present_pixmap_priv)
+                PRESENTdrop_present(present_priv, present_pixmap_priv);
+            break;
+    }
+}
+
+BOOL PRESENTReplayInit(PRESENTpriv **present_priv)
+{
+    *present_priv = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(PRESENTpriv));
+    if (!*present_priv)
+        return FALSE;
+
+    InitializeCriticalSection(&(*present_priv)->mutex_present);
+    InitializeConditionVariable(&(*present_priv)->event_cond);
+    return TRUE;
+}
+
+UINT PRESENTReplayLog(PRESENTpriv *present_priv, const struct present_record_header *log)
+{
+    const struct present_record *records = (const struct present_record *)(log + 1);
+    uint32_t first, i;
+    UINT n = 0;
+
+    EnterCriticalSection(&present_priv->mutex_present);
+    first = log->count > log->capacity ? log->count - log->capacity : 0;
+    for (i = first; i != log->count; i++)
+    {
+        const struct present_record *record = &records[i % log->capacity];
+
+        /* Still being written, or overwritten by a newer one */
+        if (record->seq != i + 1)
+            continue;
+        PRESENTreplay_record(present_priv, record);
+        n++;
+    }
+    LeaveCriticalSection(&present_priv->mutex_present);
+    return n;
+}
+
+void PRESENTReplayDestroy(PRESENTpriv *present_priv)
+{
+    unsigned i;
+
+    for (i = 0; i < present_priv->pixmap_table_size; i++)
+        HeapFree(GetProcessHeap(), 0, present_priv->pixmap_table[i]);
+    HeapFree(GetProcessHeap(), 0, present_priv->pixmap_table);
+    DeleteCriticalSection(&present_priv->mutex_present);
+    HeapFree(GetProcessHeap(), 0, present_priv);
+}
+#endif
@@ -11,6 +11,7 @@
 
 #include <wingdi.h>
 #include <X11/Xlib.h>
+#include <stdint.h>
 
 LONG PRESENTGetNewSerial(void);
 
@@ -28,8 +29,19 @@ BOOL PRESENTInit(Display *dpy, PRESENTpriv **present_priv);
  * This will take care than all pixmaps are released */
 void PRESENTDestroy(PRESENTpriv *present_priv);
 
+struct PRESENTGeometry {
+    XID window; /* 0 if there is no window */
+    int16_t x; /* relative to the parent */
+    int16_t y;
+    uint16_t width;
+    uint16_t height;
+    unsigned depth;
+    LONG generation; /* changes with any update of the window */
+};
+
+/* Consistent snapshot of the current window's geometry, doesn't lock */
+BOOL PRESENTGetGeometry(PRESENTpriv *present_priv, struct PRESENTGeometry *geom);
 BOOL PRESENTGetGeom(PRESENTpriv *present_priv, XID window, int *width, int *height, int *depth);
-BOOL PRESENTGeomUpdated(PRESENTpriv *present_priv);
 
 BOOL PRESENTPixmapCreate(PRESENTpriv *present_priv, int screen,
         Pixmap *pixmap, int width, int height, int stride, int depth,
@@ -37,6 +49,17 @@ BOOL PRESENTPixmapCreate(PRESENTpriv *present_priv, int screen,
 
 BOOL PRESENTPixmapInit(PRESENTpriv *present_priv, Pixmap pixmap, PRESENTPixmapPriv **present_pixmap_priv);
 
+/* Like PRESENTPixmapInit, without round trip, for a pixmap of known size */
+BOOL PRESENTPixmapInitWithSize(PRESENTpriv *present_priv, Pixmap pixmap, int width, int height,
+        int depth, PRESENTPixmapPriv **present_pixmap_priv);
+
+struct xshmfence;
+
+/* Attaches the fence the server triggers when it releases the pixmap.
+ * The pixmap priv owns the fence afterwards. */
+void PRESENTPixmapSetIdleFence(PRESENTPixmapPriv *present_pixmap_priv, XID fence,
+        struct xshmfence *shm_fence);
+
 BOOL PRESENTTryFreePixmap(PRESENTPixmapPriv *present_pixmap_priv);
 
 BOOL PRESENTHelperCopyFront(PRESENTPixmapPriv *present_pixmap_priv);
@@ -44,8 +67,9 @@ BOOL PRESENTHelperCopyFront(PRESENTPixmapPriv *present_pixmap_priv);
 BOOL PRESENTPixmapPrepare(XID window, PRESENTPixmapPriv *present_pixmap_priv);
 
 BOOL PRESENTPixmap(XID window, PRESENTPixmapPriv *present_pixmap_priv,
-        const UINT PresentationInterval, const BOOL PresentAsync, const BOOL SwapEffectCopy,
-        const RECT *pSourceRect, const RECT *pDestRect, const RGNDATA *pDirtyRegion);
+        const UINT PresentationInterval, const BOOL PresentAsync, const BOOL PresentMailbox,
+        const BOOL SwapEffectCopy, const RECT *pSourceRect, const RECT *pDestRect,
+        const RGNDATA *pDirtyRegion);
 
 BOOL PRESENTWaitPixmapReleased(PRESENTPixmapPriv *present_pixmap_priv);
 
@@ -53,4 +77,78 @@ BOOL PRESENTIsPixmapReleased(PRESENTPixmapPriv *present_pixmap_priv);
 
 BOOL PRESENTWaitReleaseEvent(PRESENTpriv *present_priv);
 
+struct PRESENTStats {
+    UINT present_count; /* number of the present, counting from 1 */
+    uint64_t msc; /* refresh count when it was displayed */
+    uint64_t ust; /* time of that refresh in microseconds, CLOCK_MONOTONIC */
+    uint64_t sync_msc; /* latest refresh seen, at or after msc */
+    uint64_t sync_ust;
+};
+
+/* statistics of the last present that got displayed, and the latest refresh */
+BOOL PRESENTGetStats(PRESENTpriv *present_priv, struct PRESENTStats *stats);
+
+/* refresh period in microseconds, measured from the vblanks seen */
+BOOL PRESENTGetRefreshPeriod(PRESENTpriv *present_priv, uint64_t *period);
+
+/* Time in microseconds since the scanout of the current frame started
+ * and the refresh period, both from the vblanks seen. */
+BOOL PRESENTGetVBlankPhase(PRESENTpriv *present_priv, uint64_t *elapsed, uint64_t *period);
+
+/* TRUE if the crtc of the current window can flip without vsync */
+BOOL PRESENTHasAsyncFlip(PRESENTpriv *present_priv);
+
+/* Present capabilities of the current window and options of its last present */
+BOOL PRESENTGetPresentMode(PRESENTpriv *present_priv, UINT *capabilities, UINT *options);
+
+/* TRUE if the last displayed present missed its target msc */
+BOOL PRESENTIsLate(PRESENTpriv *present_priv);
+
+/* Pixmaps PRESENTTryFreePixmap couldn't free yet, they are freed
+ * once the server releases them. oldest_age is in milliseconds. */
+void PRESENTGetDeferredFrees(PRESENTpriv *present_priv, UINT *count, DWORD *oldest_age);
+
+/* Costs of the present paths, times in microseconds (CLOCK_MONOTONIC) */
+struct PRESENTTimings {
+    UINT presents;
+    uint64_t first_present; /* time of the first and last present */
+    uint64_t last_present;
+    uint64_t present_time; /* spent in PRESENTPixmap */
+    UINT releases; /* pixmaps released by the server */
+    uint64_t release_time; /* from their present to their release */
+    uint64_t release_time_max;
+    UINT window_changes;
+    UINT window_registers; /* window changes missing the window cache */
+    uint64_t window_change_time;
+    UINT events; /* Present events handled */
+    uint64_t event_time; /* spent handling them, in nanoseconds */
+    UINT wait_timeouts; /* waits without any Present event for long */
+    UINT lost_presents; /* presents given up without their events */
+    UINT late_presents; /* displayed after their target msc */
+};
+
+void PRESENTGetTimings(PRESENTpriv *present_priv, struct PRESENTTimings *timings);
+
+/* replaced: mailbox presents sent over a queued one,
+ * skipped: presents the server dropped without displaying them */
+void PRESENTGetSkipCounters(PRESENTpriv *present_priv, UINT *replaced, UINT *skipped);
+
+/* Waits until less than max_pending presents are queued.
+ * Returns FALSE instead of waiting if dont_wait is set. */
+BOOL PRESENTWaitPendingPresents(PRESENTpriv *present_priv, int max_pending, BOOL dont_wait);
+
+#ifdef D3D9NINE_PRESENT_REPLAY
+struct present_record_header;
+
+/* A PRESENTpriv without X connection, for PRESENTReplayLog */
+BOOL PRESENTReplayInit(PRESENTpriv **present_priv);
+
+/* Feeds a log of present_record.c to the event handling, as if the
+ * presents were sent and their events came from the X server. The
+ * PRESENTGet* functions report the result. Returns the records replayed. */
+UINT PRESENTReplayLog(PRESENTpriv *present_priv, const struct present_record_header *log);
+
+void PRESENTReplayDestroy(PRESENTpriv *present_priv);
+#endif
+
 #endif /* __NINE_XCB_PRESENT_H */
@@ -0,0 +1,629 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Runs xcb_present.c against the X server of $DISPLAY
+ *
+ * Meson runs it on Xvfb through run-xvfb.sh: its Present extension works
+ * with software pixmaps, so no GPU is needed. Core pixmaps are created
+ * with PRESENTPixmapCreate and presented with copies.
+ *
+ * Usage: present-test <test>
+ *   present: presents at interval 0 and 1, checks every pixmap gets released
+ *   window:  presents to several windows, checks the window cache
+ *   represent: presents pixmaps again before their complete event, checks none is lost
+ *   replay:  replays the log of D3D_PRESENT_RECORD, checks it gives the results of the live run
+ *   alloc:   presents with rects and dirty regions, checks nothing is allocated once warmed up
+ *   bench:   prints presents/s, release latency and window switch cost
+ *   bench-pixmaps: prints the cost of a Present event as the pixmap count grows
+ *   bench-dirty: prints presents/s with the dirty regions of typical engines
+ */
+
+#include <windows.h>
+#include <X11/Xlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../d3d9-nine/present_record.h"
+#include "../d3d9-nine/xcb_present.h"
+
+#define WIDTH 640
+#define HEIGHT 480
+#define NUM_BUFFERS 3
+/* more than PRESENT_WINDOW_CACHE_SIZE, to miss the cache */
+#define NUM_WINDOWS 6
+/* pixmaps kept around without being presented, like leaked ones */
+#define MAX_IDLE_PIXMAPS 4096
+#define MAX_DIRTY_RECTS 1200
+
+struct context
+{
+    Display *dpy;
+    int screen;
+    int depth;
+    PRESENTpriv *present_priv;
+    Window windows[NUM_WINDOWS];
+    PRESENTPixmapPriv *buffers[NUM_BUFFERS];
+    unsigned next;
+};
+
+static unsigned failures;
+
+/* Allocations of the code linked in, counted by wrapping them with ld --wrap */
+static LONG heap_allocs, mallocs;
+
+void * WINAPI __real_HeapAlloc(HANDLE heap, DWORD flags, SIZE_T size);
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void * WINAPI __wrap_HeapAlloc(HANDLE heap, DWORD flags, SIZE_T size)
+{
+    InterlockedIncrement(&heap_allocs);
+    return __real_HeapAlloc(heap, flags, size);
+}
+
+void *__wrap_malloc(size_t size)
+{
+    InterlockedIncrement(&mallocs);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    InterlockedIncrement(&mallocs);
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    InterlockedIncrement(&mallocs);
+    return __real_realloc(ptr, size);
+}
+
+#define check(cond, ...) \
+    do { if (!(cond)) { failures++; fprintf(stderr, __VA_ARGS__); } } while (0)
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned long long average(uint64_t total, unsigned count)
+{
+    return count ? total / count : 0;
+}
+
+static BOOL create_pixmap(struct context *ctx, int width, int height,
+        PRESENTPixmapPriv **present_pixmap_priv)
+{
+    Pixmap pixmap;
+
+    return PRESENTPixmapCreate(ctx->present_priv, ctx->screen, &pixmap, width, height,
+            width * 4, ctx->depth, 32) &&
+           PRESENTPixmapInit(ctx->present_priv, pixmap, present_pixmap_priv);
+}
+
+static BOOL context_init(struct context *ctx)
+{
+    unsigned i;
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->dpy = XOpenDisplay(NULL);
+    if (!ctx->dpy)
+    {
+        fprintf(stderr, "Can't open the display\n");
+        return FALSE;
+    }
+    ctx->screen = DefaultScreen(ctx->dpy);
+    ctx->depth = DefaultDepth(ctx->dpy, ctx->screen);
+
+    if (!PRESENTCheckExtension(ctx->dpy, 1, 0) || !PRESENTInit(ctx->dpy, &ctx->present_priv))
+    {
+        fprintf(stderr, "Can't initialize Present\n");
+        return FALSE;
+    }
+
+    for (i = 0; i < NUM_WINDOWS; i++)
+    {
+        ctx->windows[i] = XCreateSimpleWindow(ctx->dpy, RootWindow(ctx->dpy, ctx->screen),
+                0, 0, WIDTH, HEIGHT, 0, 0, 0);
+        XMapWindow(ctx->dpy, ctx->windows[i]);
+    }
+    XSync(ctx->dpy, False);
+
+    for (i = 0; i < NUM_BUFFERS; i++)
+    {
+        if (!create_pixmap(ctx, WIDTH, HEIGHT, &ctx->buffers[i]))
+        {
+            fprintf(stderr, "Can't create the pixmaps\n");
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static void context_destroy(struct context *ctx)
+{
+    unsigned i;
+
+    for (i = 0; i < NUM_BUFFERS; i++)
+    {
+        if (ctx->buffers[i])
+            PRESENTTryFreePixmap(ctx->buffers[i]);
+    }
+    if (ctx->present_priv)
+        PRESENTDestroy(ctx->present_priv);
+    for (i = 0; i < NUM_WINDOWS; i++)
+    {
+        if (ctx->windows[i])
+            XDestroyWindow(ctx->dpy, ctx->windows[i]);
+    }
+    if (ctx->dpy)
+        XCloseDisplay(ctx->dpy);
+}
+
+/* Presents the next buffer once the server released it, like the driver does */
+static BOOL present(struct context *ctx, Window window, UINT interval, const RGNDATA *dirty)
+{
+    PRESENTPixmapPriv *buffer = ctx->buffers[ctx->next++ % NUM_BUFFERS];
+
+    return PRESENTWaitPixmapReleased(buffer) &&
+           PRESENTPixmapPrepare(window, buffer) &&
+           PRESENTPixmap(window, buffer, interval, FALSE, FALSE, TRUE, NULL, NULL, dirty);
+}
+
+static void wait_releases(struct context *ctx)
+{
+    unsigned i;
+
+    for (i = 0; i < NUM_BUFFERS; i++)
+        check(PRESENTWaitPixmapReleased(ctx->buffers[i]), "Buffer %u not released\n", i);
+}
+
+/* Waits for the complete events of all presents, without resync */
+static BOOL wait_presents(struct context *ctx, DWORD timeout)
+{
+    DWORD start = GetTickCount();
+
+    while (!PRESENTWaitPendingPresents(ctx->present_priv, 1, TRUE))
+    {
+        if (GetTickCount() - start > timeout)
+            return FALSE;
+        Sleep(1);
+    }
+    return TRUE;
+}
+
+static void check_no_lost_events(struct context *ctx)
+{
+    struct PRESENTTimings timings;
+
+    PRESENTGetTimings(ctx->present_priv, &timings);
+    check(!timings.wait_timeouts, "%u waits timed out\n", timings.wait_timeouts);
+    check(!timings.lost_presents, "%u presents lost\n", timings.lost_presents);
+}
+
+static void test_present(struct context *ctx)
+{
+    struct PRESENTTimings timings;
+    uint64_t start, elapsed;
+    unsigned i;
+
+    for (i = 0; i < 200; i++)
+        check(present(ctx, ctx->windows[0], 0, NULL), "Present %u at interval 0 failed\n", i);
+
+    /* Paced by the refresh of the fake crtc of Xvfb, about 60 Hz */
+    start = now_us();
+    for (i = 0; i < 30; i++)
+        check(present(ctx, ctx->windows[0], 1, NULL), "Present %u at interval 1 failed\n", i);
+    wait_releases(ctx);
+    elapsed = now_us() - start;
+    check(elapsed > 25 * 1000000 / 60, "30 presents at interval 1 took only %lluus\n",
+          (unsigned long long)elapsed);
+
+    PRESENTGetTimings(ctx->present_priv, &timings);
+    check(timings.presents == 230, "%u presents counted\n", timings.presents);
+    check(timings.releases >= 230 - NUM_BUFFERS, "Only %u releases seen\n", timings.releases);
+    check_no_lost_events(ctx);
+}
+
+static BOOL present_mailbox(struct context *ctx, PRESENTPixmapPriv *buffer)
+{
+    return PRESENTWaitPixmapReleased(buffer) &&
+           PRESENTPixmapPrepare(ctx->windows[0], buffer) &&
+           PRESENTPixmap(ctx->windows[0], buffer, 0, FALSE, TRUE, TRUE, NULL, NULL, NULL);
+}
+
+/* A mailbox present replaced by the next one releases its pixmap right
+ * away, but completes at the vblank only: the pixmap can be presented
+ * again before its complete event arrives. */
+static void test_represent(struct context *ctx)
+{
+    PRESENTPixmapPriv *a = ctx->buffers[0], *b = ctx->buffers[1];
+    UINT replaced, skipped;
+    unsigned i;
+
+    for (i = 0; i < 50; i++)
+    {
+        check(present_mailbox(ctx, a) && present_mailbox(ctx, b) && present_mailbox(ctx, a),
+              "Mailbox presents %u failed\n", i);
+        /* Every complete event must find its pixmap */
+        check(wait_presents(ctx, 1000), "Presents %u still pending\n", i);
+    }
+    wait_releases(ctx);
+
+    PRESENTGetSkipCounters(ctx->present_priv, &replaced, &skipped);
+    check(replaced == 100, "%u mailbox presents replaced\n", replaced);
+    check(skipped, "The server replaced no present\n");
+    check_no_lost_events(ctx);
+}
+
+/* The event handling gets the same events from the log as from the server */
+static void test_replay(struct context *ctx)
+{
+    struct PRESENTTimings live_timings, timings;
+    struct PRESENTStats live_stats, stats;
+    UINT live_skipped, skipped, replaced;
+    struct present_record_header *log;
+    PRESENTpriv *replay_priv;
+    size_t size;
+    unsigned i;
+
+    if (!present_record_log)
+    {
+        check(FALSE, "D3D_PRESENT_RECORD isn't set\n");
+        return;
+    }
+
+    for (i = 0; i < 20; i++)
+    {
+        check(present_mailbox(ctx, ctx->buffers[0]) && present_mailbox(ctx, ctx->buffers[1]),
+              "Mailbox presents %u failed\n", i);
+        check(present(ctx, ctx->windows[i % 2], 1, NULL), "Present %u at interval 1 failed\n", i);
+    }
+    check(wait_presents(ctx, 1000), "Presents still pending\n");
+    wait_releases(ctx);
+
+    /* The replay records its events as well, it can't read the log being written */
+    size = sizeof(*log) + (size_t)present_record_log->capacity * present_record_log->record_size;
+    log = HeapAlloc(GetProcessHeap(), 0, size);
+    if (!log)
+        return;
+    memcpy(log, present_record_log, size);
+    PRESENTGetTimings(ctx->present_priv, &live_timings);
+    PRESENTGetSkipCounters(ctx->present_priv, &replaced, &live_skipped);
+    check(PRESENTGetStats(ctx->present_priv, &live_stats), "No present displayed\n");
+
+    if (!PRESENTReplayInit(&replay_priv))
+    {
+        check(FALSE, "Can't initialize the replay\n");
+        HeapFree(GetProcessHeap(), 0, log);
+        return;
+    }
+    check(PRESENTReplayLog(replay_priv, log) >= 2 * live_timings.presents,
+          "Records missing from the log\n");
+
+    PRESENTGetTimings(replay_priv, &timings);
+    PRESENTGetSkipCounters(replay_priv, &replaced, &skipped);
+    check(timings.presents == live_timings.presents, "%u presents replayed of %u\n",
+          timings.presents, live_timings.presents);
+    check(skipped == live_skipped, "%u skipped presents replayed of %u\n", skipped, live_skipped);
+    check(timings.late_presents == live_timings.late_presents, "%u late presents replayed of %u\n",
+          timings.late_presents, live_timings.late_presents);
+    check(PRESENTWaitPendingPresents(replay_priv, 1, TRUE), "Replayed presents still pending\n");
+    check(PRESENTGetStats(replay_priv, &stats) && stats.present_count == live_stats.present_count &&
+          stats.msc == live_stats.msc && stats.ust == live_stats.ust,
+          "The replay displayed present %u at msc %llu, not %u at msc %llu\n", stats.present_count,
+          (unsigned long long)stats.msc, live_stats.present_count, (unsigned long long)live_stats.msc);
+
+    PRESENTReplayDestroy(replay_priv);
+    HeapFree(GetProcessHeap(), 0, log);
+    check_no_lost_events(ctx);
+}
+
+static void test_window(struct context *ctx)
+{
+    struct PRESENTTimings timings;
+    unsigned i;
+
+    /* Two windows stay in the cache */
+    for (i = 0; i < 100; i++)
+        check(present(ctx, ctx->windows[i % 2], 0, NULL), "Present %u failed\n", i);
+    PRESENTGetTimings(ctx->present_priv, &timings);
+    check(timings.window_changes == 100, "%u window changes\n", timings.window_changes);
+    check(timings.window_registers == 2, "%u windows registered\n", timings.window_registers);
+
+    /* More windows than the cache keeps: the evicted ones get their pixmaps back */
+    for (i = 0; i < 100; i++)
+        check(present(ctx, ctx->windows[i % NUM_WINDOWS], 0, NULL), "Present %u failed\n", i);
+    wait_releases(ctx);
+    PRESENTGetTimings(ctx->present_priv, &timings);
+    check(timings.window_registers > 2 + NUM_WINDOWS, "%u windows registered\n",
+          timings.window_registers);
+    check_no_lost_events(ctx);
+}
+
+static void bench(struct context *ctx)
+{
+    struct PRESENTTimings timings;
+    uint64_t start, elapsed, switch_time;
+    unsigned i, switches, registers;
+
+    start = now_us();
+    for (i = 0; i < 2000; i++)
+        present(ctx, ctx->windows[0], 0, NULL);
+    wait_releases(ctx);
+    elapsed = now_us() - start;
+
+    PRESENTGetTimings(ctx->present_priv, &timings);
+    printf("presents:         %.0f/s, %lluus in PRESENTPixmap\n",
+           2000 * 1000000.0 / elapsed, average(timings.present_time, timings.presents));
+    printf("release latency:  %lluus average, %lluus max\n",
+           average(timings.release_time, timings.releases),
+           (unsigned long long)timings.release_time_max);
+
+    switches = timings.window_changes;
+    switch_time = timings.window_change_time;
+    for (i = 0; i < 1000; i++)
+        present(ctx, ctx->windows[i % 2], 0, NULL);
+    PRESENTGetTimings(ctx->present_priv, &timings);
+    printf("window switch:    %lluus cached\n",
+           average(timings.window_change_time - switch_time, timings.window_changes - switches));
+
+    switches = timings.window_changes;
+    switch_time = timings.window_change_time;
+    registers = timings.window_registers;
+    for (i = 0; i < 1000; i++)
+        present(ctx, ctx->windows[i % NUM_WINDOWS], 0, NULL);
+    wait_releases(ctx);
+    PRESENTGetTimings(ctx->present_priv, &timings);
+    printf("window switch:    %lluus with %u of %u missing the cache\n",
+           average(timings.window_change_time - switch_time, timings.window_changes - switches),
+           timings.window_registers - registers, timings.window_changes - switches);
+    check_no_lost_events(ctx);
+}
+
+/* The event thread looks up the pixmap of every CompleteNotify and
+ * IdleNotify event, its cost shouldn't depend on the pixmap count */
+static void bench_pixmaps(struct context *ctx)
+{
+    static const unsigned counts[] = {0, 64, 512, MAX_IDLE_PIXMAPS};
+    struct PRESENTTimings timings;
+    PRESENTPixmapPriv **idle;
+    uint64_t event_time;
+    unsigned i, j, n = 0, events;
+
+    idle = HeapAlloc(GetProcessHeap(), 0, MAX_IDLE_PIXMAPS * sizeof(*idle));
+    if (!idle)
+        return;
+
+    for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+    {
+        for (; n < counts[i]; n++)
+        {
+            if (!create_pixmap(ctx, 16, 16, &idle[n]))
+                break;
+        }
+        check(n == counts[i], "Only %u idle pixmaps created\n", n);
+
+        PRESENTGetTimings(ctx->present_priv, &timings);
+        events = timings.events;
+        event_time = timings.event_time;
+        for (j = 0; j < 1000; j++)
+            present(ctx, ctx->windows[0], 0, NULL);
+        wait_releases(ctx);
+        PRESENTGetTimings(ctx->present_priv, &timings);
+        printf("%4u pixmaps:     %lluns per event\n", n + NUM_BUFFERS,
+               average(timings.event_time - event_time, timings.events - events));
+    }
+    check_no_lost_events(ctx);
+
+    for (i = 0; i < n; i++)
+        PRESENTTryFreePixmap(idle[i]);
+    HeapFree(GetProcessHeap(), 0, idle);
+}
+
+static RGNDATA *dirty_region(unsigned count)
+{
+    RGNDATA *region;
+
+    region = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
+            sizeof(RGNDATAHEADER) + count * sizeof(RECT));
+    if (!region)
+        return NULL;
+    region->rdh.dwSize = sizeof(RGNDATAHEADER);
+    region->rdh.iType = RDH_RECTANGLES;
+    region->rdh.nCount = count;
+    region->rdh.nRgnSize = count * sizeof(RECT);
+    SetRect(&region->rdh.rcBound, 0, 0, WIDTH, HEIGHT);
+    return region;
+}
+
+/* Fills the region like an engine would, frame by frame */
+static void dirty_pattern(RGNDATA *region, const char *pattern, unsigned frame)
+{
+    RECT *rects = (RECT *)region->Buffer;
+    unsigned i, seed = frame * 2654435761u;
+    int x, y;
+
+    if (!strcmp(pattern, "hud"))
+    {
+        /* a few widgets at the edges */
+        for (i = 0; i < region->rdh.nCount; i++)
+        {
+            x = (i % 4) * (WIDTH / 4);
+            y = i < 4 ? 0 : HEIGHT - 40;
+            SetRect(&rects[i], x + 4, y + 4, x + WIDTH / 4 - 4, y + 36);
+        }
+    }
+    else if (!strcmp(pattern, "sprites"))
+    {
+        /* small overlapping rects along moving sprites, some off the pixmap */
+        for (i = 0; i < region->rdh.nCount; i++)
+        {
+            x = (int)((frame * 3 + i * 7) % (WIDTH + 32)) - 16;
+            y = (int)((i * 13) % (HEIGHT + 32)) - 16;
+            SetRect(&rects[i], x, y, x + 24, y + 24);
+        }
+    }
+    else if (!strcmp(pattern, "tiles"))
+    {
+        /* adjacent 16x16 tiles of a scrolling area */
+        for (i = 0; i < region->rdh.nCount; i++)
+        {
+            x = (i % 40) * 16;
+            y = (i / 40) * 16;
+            SetRect(&rects[i], x, y, x + 16, y + 16);
+        }
+    }
+    else
+    {
+        /* scattered glyphs of text */
+        for (i = 0; i < region->rdh.nCount; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            x = (seed >> 8) % (WIDTH - 8);
+            y = (seed >> 20) % (HEIGHT - 12);
+            SetRect(&rects[i], x, y, x + 8, y + 12);
+        }
+    }
+}
+
+/* Once the windows, regions and pixmaps exist, presenting allocates nothing */
+static void test_alloc(struct context *ctx)
+{
+    PRESENTPixmapPriv *buffer;
+    LONG heap = 0, mem = 0;
+    RGNDATA *region;
+    RECT src, dst;
+    unsigned i;
+
+    region = dirty_region(8);
+    if (!region)
+        return;
+    SetRect(&src, 0, 0, WIDTH / 2, HEIGHT / 2);
+    SetRect(&dst, 16, 16, 16 + WIDTH / 2, 16 + HEIGHT / 2);
+
+    /* 100 frames of warm-up, 100 frames counted */
+    for (i = 0; i < 200; i++)
+    {
+        if (i == 100)
+        {
+            heap = InterlockedCompareExchange(&heap_allocs, 0, 0);
+            mem = InterlockedCompareExchange(&mallocs, 0, 0);
+        }
+        dirty_pattern(region, "hud", i);
+        buffer = ctx->buffers[i % NUM_BUFFERS];
+        check(PRESENTWaitPixmapReleased(buffer) &&
+              PRESENTPixmapPrepare(ctx->windows[i % 2], buffer) &&
+              PRESENTPixmap(ctx->windows[i % 2], buffer, 0, FALSE, FALSE, TRUE, &src, &dst, region),
+              "Present %u failed\n", i);
+    }
+    wait_releases(ctx);
+
+    heap = InterlockedCompareExchange(&heap_allocs, 0, 0) - heap;
+    mem = InterlockedCompareExchange(&mallocs, 0, 0) - mem;
+    check(!heap && !mem, "%d HeapAlloc and %d malloc calls in 100 frames\n", heap, mem);
+    check_no_lost_events(ctx);
+    HeapFree(GetProcessHeap(), 0, region);
+}
+
+/* The server has to do region math and copies for every rectangle
+ * PRESENTPixmap sends, depending on how well it simplifies them */
+static void bench_dirty(struct context *ctx)
+{
+    static const struct
+    {
+        const char *pattern;
+        unsigned count;
+    }
+    patterns[] =
+    {
+        {"full", 0},
+        {"hud", 8},
+        {"sprites", 300},
+        {"tiles", MAX_DIRTY_RECTS},
+        {"text", 200},
+    };
+    struct PRESENTTimings timings;
+    uint64_t start, elapsed, present_time;
+    RGNDATA *region;
+    unsigned i, j, presents;
+
+    region = dirty_region(MAX_DIRTY_RECTS);
+    if (!region)
+        return;
+
+    for (i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++)
+    {
+        PRESENTGetTimings(ctx->present_priv, &timings);
+        presents = timings.presents;
+        present_time = timings.present_time;
+        region->rdh.nCount = patterns[i].count;
+        region->rdh.nRgnSize = patterns[i].count * sizeof(RECT);
+
+        start = now_us();
+        for (j = 0; j < 1000; j++)
+        {
+            dirty_pattern(region, patterns[i].pattern, j);
+            present(ctx, ctx->windows[0], 0, patterns[i].count ? region : NULL);
+        }
+        wait_releases(ctx);
+        elapsed = now_us() - start;
+
+        PRESENTGetTimings(ctx->present_priv, &timings);
+        printf("%-8s %4u rects: %.0f presents/s, %lluus in PRESENTPixmap\n",
+               patterns[i].pattern, patterns[i].count, 1000 * 1000000.0 / elapsed,
+               average(timings.present_time - present_time, timings.presents - presents));
+    }
+    check_no_lost_events(ctx);
+    HeapFree(GetProcessHeap(), 0, region);
+}
+
+int main(int argc, char **argv)
+{
+    struct context ctx;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s present|window|represent|replay|alloc|bench|bench-pixmaps|bench-dirty\n", argv[0]);
+        return 2;
+    }
+
+    if (!context_init(&ctx))
+    {
+        context_destroy(&ctx);
+        return 1;
+    }
+
+    if (!strcmp(argv[1], "present"))
+        test_present(&ctx);
+    else if (!strcmp(argv[1], "window"))
+        test_window(&ctx);
+    else if (!strcmp(argv[1], "represent"))
+        test_represent(&ctx);
+    else if (!strcmp(argv[1], "replay"))
+        test_replay(&ctx);
+    else if (!strcmp(argv[1], "alloc"))
+        test_alloc(&ctx);
+    else if (!strcmp(argv[1], "bench"))
+        bench(&ctx);
+    else if (!strcmp(argv[1], "bench-pixmaps"))
+        bench_pixmaps(&ctx);
+    else if (!strcmp(argv[1], "bench-dirty"))
+        bench_dirty(&ctx);
+    else
+    {
+        fprintf(stderr, "Unknown test %s\n", argv[1]);
+        failures++;
+    }
+
+    context_destroy(&ctx);
+    if (failures)
+        fprintf(stderr, "%u failures\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,31 @@
+#!/bin/sh -e
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+# Usage: run-xvfb.sh <Xvfb> <wine> <program> [args...]
+# Runs a winelib program on a private Xvfb server. Exits with 77, which
+# meson reports as a skipped test, when Xvfb doesn't come up.
+
+XVFB=$1
+WINE=$2
+shift 2
+
+DISPLAYFD=$(mktemp)
+trap 'kill $XVFB_PID 2>/dev/null; rm -f "$DISPLAYFD"' EXIT
+
+"$XVFB" -displayfd 3 -screen 0 1024x768x24 -nolisten tcp 3>"$DISPLAYFD" 2>/dev/null &
+XVFB_PID=$!
+
+i=0
+while test ! -s "$DISPLAYFD"; do
+	if test $i -ge 100 || ! kill -0 $XVFB_PID 2>/dev/null; then
+		echo "Xvfb didn't start, skipping"
+		exit 77
+	fi
+	sleep 0.1
+	i=$((i + 1))
+done
+
+DISPLAY=:$(cat "$DISPLAYFD")
+export DISPLAY
+
+"$WINE" "$@"
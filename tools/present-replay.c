@@ -0,0 +1,133 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Replays a log of d3d9-nine/present_record.c
+ *
+ * The recorded presents and Present events are fed to the event handling
+ * of xcb_present.c, as if they came from the X server, and the pacing
+ * statistics it collects are printed. The replay can be repeated to
+ * benchmark the event handling, and fails when the late or skipped
+ * presents exceed the given limits, to catch regressions between logs
+ * or between versions of xcb_present.c.
+ *
+ * Usage: present-replay [-n repeat] [-l max late %] [-s max skipped %] log
+ */
+
+#include <windows.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../d3d9-nine/present_record.h"
+#include "../d3d9-nine/xcb_present.h"
+
+static double percent(unsigned part, unsigned total)
+{
+    return total ? 100.0 * part / total : 0.0;
+}
+
+int main(int argc, char **argv)
+{
+    const struct present_record_header *header;
+    double max_late = 100.0, max_skipped = 100.0, elapsed;
+    unsigned repeat = 1, records = 0, i;
+    struct PRESENTTimings timings;
+    struct PRESENTStats stats;
+    struct timespec start, end;
+    PRESENTpriv *present_priv;
+    UINT replaced, skipped;
+    uint64_t period;
+    BOOL have_period;
+    struct stat st;
+    int opt, fd, ret = 0;
+
+    while ((opt = getopt(argc, argv, "n:l:s:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n': repeat = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+            case 'l': max_late = atof(optarg); break;
+            case 's': max_skipped = atof(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-n repeat] [-l max late %%] [-s max skipped %%] log\n", argv[0]);
+                return 2;
+        }
+    }
+    if (optind >= argc)
+    {
+        fprintf(stderr, "Usage: %s [-n repeat] [-l max late %%] [-s max skipped %%] log\n", argv[0]);
+        return 2;
+    }
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) || st.st_size < (off_t)sizeof(*header))
+    {
+        fprintf(stderr, "Can't read %s\n", argv[optind]);
+        return 2;
+    }
+    header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED)
+    {
+        fprintf(stderr, "Can't map %s\n", argv[optind]);
+        return 2;
+    }
+
+    if (header->magic != PRESENT_RECORD_MAGIC || header->version != PRESENT_RECORD_VERSION ||
+        header->record_size != sizeof(struct present_record) || !header->capacity ||
+        st.st_size < (off_t)(sizeof(*header) + (size_t)header->capacity * header->record_size))
+    {
+        fprintf(stderr, "%s is not a present record of version %u\n", argv[optind], PRESENT_RECORD_VERSION);
+        return 2;
+    }
+
+    /* The replay of the last run is kept for the statistics */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < repeat; i++)
+    {
+        if (i)
+            PRESENTReplayDestroy(present_priv);
+        if (!PRESENTReplayInit(&present_priv))
+            return 2;
+        records = PRESENTReplayLog(present_priv, header);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    PRESENTGetTimings(present_priv, &timings);
+    PRESENTGetSkipCounters(present_priv, &replaced, &skipped);
+    have_period = PRESENTGetRefreshPeriod(present_priv, &period);
+
+    printf("records:    %u of %u written\n", records, header->count);
+    printf("presents:   %u%s\n", timings.presents,
+           PRESENTWaitPendingPresents(present_priv, 1, TRUE) ? "" : ", the last ones not completed");
+    printf("late:       %u (%.1f%%)\n", timings.late_presents,
+           percent(timings.late_presents, timings.presents));
+    printf("skipped:    %u (%.1f%%)\n", skipped, percent(skipped, timings.presents));
+    printf("released:   %u\n", timings.releases);
+    if (PRESENTGetStats(present_priv, &stats))
+        printf("last shown: present %u at msc %llu\n", stats.present_count,
+               (unsigned long long)stats.msc);
+    if (have_period)
+        printf("refresh:    %lluus\n", (unsigned long long)period);
+    printf("events:     %u, %lluns per event\n", timings.events,
+           timings.events ? (unsigned long long)(timings.event_time / timings.events) : 0);
+    printf("replay:     %.0f records/s\n", elapsed > 0 ? (double)records * repeat / elapsed : 0.0);
+
+    if (percent(timings.late_presents, timings.presents) > max_late)
+    {
+        fprintf(stderr, "Too many late presents\n");
+        ret = 1;
+    }
+    if (percent(skipped, timings.presents) > max_skipped)
+    {
+        fprintf(stderr, "Too many skipped presents\n");
+        ret = 1;
+    }
+
+    PRESENTReplayDestroy(present_priv);
+    return ret;
+}